@@ -1,25 +1,43 @@
 #include <string>
 #include <iostream>
 #include <thread>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include "easywsclient.hpp"
 #include "utils/mathlib.hpp"
+#include "utils/sparse.hpp"
 #include "utils/dataModel.hpp"
+#include "utils/lruCache.hpp"
+#include "utils/packing.hpp"
 
 #include <cstdlib>
 #include <csignal>
 
-Vector deserialize_vector_for_web(const std::string &s)
+// operand buffers come from `arena`, or from the heap if it is null
+Vector make_operand_vector(int size, Arena *arena)
 {
-    Vector result(VECTOR_SIZE);
+    return arena ? Vector(size, *arena) : Vector(size);
+}
+
+Vector deserialize_vector_for_web(std::string_view s, Arena *arena)
+{
+    // every element is followed by a space
+    int size = std::count(s.begin(), s.end(), ' ') + (!s.empty() && s.back() != ' ');
+    Vector result = make_operand_vector(size, arena);
     // parse int for splitted by space, do not use s.erase
     std::string delimiter = " ";
     size_t pos = 0;
-    int cur = 0, sign = 1;
+    int cur = 0, sign = 1, bound = 0;
     for (int i = 0; i < s.size(); i++)
     {
         if (s[i] == ' ')
         {
             result.set(pos, cur);
+            bound = std::max(bound, std::abs(cur));
             cur = 0, sign = 1;
             pos++;
         }
@@ -32,12 +50,115 @@ Vector deserialize_vector_for_web(const std::string &s)
             cur = cur * 10 + sign * (s[i] - '0');
         }
     }
-    if (cur != 0 && pos < VECTOR_SIZE)
+    if (pos < size)
+    {
         result.set(pos, cur);
+        bound = std::max(bound, std::abs(cur));
+    }
+    // tracked while parsing so dot() can go straight to the narrow kernel
+    result.bound = bound;
+
+    return result;
+}
+
+// "@size delta:value delta:value ...", see serialize_sparse_vector_for_web
+void deserialize_sparse_vector_for_web(std::string_view s, SparseVector &result)
+{
+    size_t i = 1;
+    int size = 0;
+    for (; i < s.size() && s[i] != ' '; i++)
+        size = size * 10 + (s[i] - '0');
+    result.clear(size);
+
+    int index = -1, cur = 0, sign = 1;
+    for (i++; i < s.size(); i++)
+    {
+        if (s[i] == ':')
+        {
+            index += cur;
+            cur = 0, sign = 1;
+        }
+        else if (s[i] == ' ')
+        {
+            result.push(index, cur);
+            cur = 0, sign = 1;
+        }
+        else if (s[i] == '-')
+        {
+            cur = 0, sign = -1;
+        }
+        else
+        {
+            cur = cur * 10 + sign * (s[i] - '0');
+        }
+    }
+}
 
+// raw int32 payload, int16 with FRAME_INT16, or a packed block with
+// FRAME_PACKED; see serialize_vector_binary / serialize_vector_packed
+Vector deserialize_vector_binary(std::string_view s, uint16_t flags, Arena *arena)
+{
+    if (flags & FRAME_PACKED)
+    {
+        Vector result = make_operand_vector(std::max(packedCount(s), 0LL), arena);
+        unpackVector(s, result.data, result.bound);
+        return result;
+    }
+    if (!(flags & FRAME_INT16))
+    {
+        Vector result = make_operand_vector(s.size() / sizeof(int32_t), arena);
+        std::memcpy(result.data, s.data(), (size_t)result.size * sizeof(int32_t));
+        return result;
+    }
+    Vector result = make_operand_vector(s.size() / sizeof(int16_t), arena);
+    int bound = 0;
+    for (int i = 0; i < result.size; i++)
+    {
+        int16_t x;
+        std::memcpy(&x, s.data() + i * sizeof(int16_t), sizeof(x));
+        result.data[i] = x;
+        bound = std::max(bound, std::abs((int)x));
+    }
+    result.bound = bound;
     return result;
 }
 
+// see serialize_sparse_vector_binary / serialize_sparse_vector_packed
+void deserialize_sparse_vector_binary(std::string_view s, uint16_t flags, SparseVector &result)
+{
+    if (flags & FRAME_PACKED)
+    {
+        result.clear(decode_scalar<int32_t>(s));
+        uint32_t nnz = decode_scalar<uint32_t>(s.substr(std::min(s.size(), sizeof(int32_t))));
+        s.remove_prefix(std::min(s.size(), 2 * sizeof(int32_t)));
+        if (nnz > s.size())
+            return; // malformed: every index takes a byte at least
+        result.index.resize(nnz);
+        int index = -1;
+        uint32_t gap = 0;
+        for (uint32_t k = 0; k < nnz && getVarint(s, gap); k++)
+            result.index[k] = index += gap;
+        result.value.resize(nnz);
+        int bound;
+        if (packedCount(s) != nnz || unpackVector(s, result.value.data(), bound) == 0)
+            result.clear(result.size); // malformed
+        return;
+    }
+    size_t width = (flags & FRAME_INT16) ? sizeof(int16_t) : sizeof(int32_t);
+    int nnz = (s.size() - sizeof(int32_t)) / (sizeof(int32_t) + width);
+    result.clear(decode_scalar<int32_t>(s));
+    result.index.resize(nnz);
+    result.value.resize(nnz);
+    const char *p = s.data() + sizeof(int32_t);
+    std::memcpy(result.index.data(), p, nnz * sizeof(int32_t));
+    p += nnz * sizeof(int32_t);
+    if (width == sizeof(int32_t))
+        std::memcpy(result.value.data(), p, nnz * sizeof(int32_t));
+    else
+        for (int k = 0; k < nnz; k++)
+            result.value[k] = decode_scalar<int16_t>(std::string_view(p + k * width, width));
+}
+
 bool connect_to_server(easywsclient::WebSocket::pointer &ws, const std::string &url)
 {
     for (int i = 0; i < 5; i++)
@@ -63,6 +184,71 @@ bool connect_to_server(easywsclient::WebSocket::pointer &ws, const std::string &
     return false;
 }
 
+// one received operand, dense or sparse
+struct Operand
+{
+    Vector dense;
+    SparseVector sparse;
+    bool is_sparse = false;
+
+    int size() const
+    {
+        return is_sparse ? sparse.size : dense.size;
+    }
+
+    long long dot(const Operand &other) const
+    {
+        return is_sparse ? sparse.dot(other.sparse) : dense.dot(other.dense);
+    }
+};
+
+// One task's operands and results. Operands that are not cached live in a
+// and b, with buffers from the arena; cache hits are pinned, so a later
+// task can evict them from the cache while this one is still computing.
+struct Work
+{
+    int action_id = -1;
+    std::vector<Operand> a, b;
+    std::vector<const Operand *> op_a, op_b; // a block each for tiled jobs
+    std::vector<std::shared_ptr<const Operand>> pinned;
+    std::vector<long long> results; // op_a x op_b dot products, row-major
+    Arena arena;
+
+    // drops the previous task's operands before their buffers are reused
+    void reset()
+    {
+        for (auto &op : a)
+            op.dense.release();
+        for (auto &op : b)
+            op.dense.release();
+        pinned.clear();
+        arena.reset();
+    }
+
+    void compute()
+    {
+        results.resize(op_a.size() * op_b.size());
+        bool dense = std::none_of(op_a.begin(), op_a.end(), [](const Operand *op)
+                                  { return op->is_sparse; });
+        if (dense && results.size() > 1)
+        {
+            // a whole tile at once with the register-blocked kernel
+            std::vector<const Vector *> rows, cols;
+            for (const Operand *op : op_a)
+                rows.push_back(&op->dense);
+            for (const Operand *op : op_b)
+                cols.push_back(&op->dense);
+            LongMatrix block = dotBlock(rows, cols);
+            for (size_t i = 0; i < op_a.size(); i++)
+                std::copy(block.rowPtr(i), block.rowPtr(i) + op_b.size(), results.begin() + i * op_b.size());
+            return;
+        }
+        for (size_t i = 0; i < op_a.size(); i++)
+            for (size_t j = 0; j < op_b.size(); j++)
+                results[i * op_b.size() + j] = op_a[i]->dot(*op_b[j]);
+    }
+};
+
 class NodeHandler
 {
 public:
@@ -70,7 +256,29 @@ public:
     int node_id;
 
     int action_id;
-    Vector a, b;
+    Work current;                         // the fetched (GET_A/GET_B) or single pushed action
+    std::vector<std::string_view> parts;  // scratch for splitting blocks
+    int cache_entries = 1024;             // operands kept across tasks, 0 for none
+    LruCache<int, std::shared_ptr<Operand>> cache;
+    bool binary = true; // framed protocol; false speaks text like the browser worker
+    bool push = true;   // ask for whole tasks (TASK) instead of fetching operands
+    int credits = 32;   // most pushed tasks the server may keep outstanding with us
+    bool pack = true;   // bit-packed operands; only binary frames carry them
+
+    struct QueuedTask
+    {
+        int action_id;
+        bool frame;
+        uint16_t flags;
+        std::string payload; // as in a TASK message
+    };
+    std::deque<QueuedTask> queued;            // pushed tasks not decoded yet
+    std::vector<std::unique_ptr<Work>> spare; // finished Work, kept for its buffers
+    int in_flight = 0;                        // tasks decoded but not finished
+    int window = 1;                           // tasks the server keeps out with us, as of its last batch
+    std::string returns;                      // RETURNS payload being collected
+    int return_count = 0;
+    std::chrono::milliseconds delay{0};       // wait this long before sending the response
     NodeHandler(int node_id)
     {
         this->node_id = node_id;
@@ -78,7 +286,105 @@ public:
 
     std::tuple<std::string, std::string> make_enter()
     {
-        return std::make_tuple("ENTER", "");
+        EnterOptions options;
+        options.push = push;
+        options.credits = push ? credits : 1;
+        options.cache = EnterOptions::clampCache(cache_entries);
+        options.pack = pack && binary;
+        cache = LruCache<int, std::shared_ptr<Operand>>(options.cache);
+        return std::make_tuple("ENTER", options.serialize());
+    }
+
+    std::string format(const std::string &op_type, int action_id, std::string_view data)
+    {
+        if (binary)
+            return format_frame(node_id, op_from_name(op_type), action_id, data);
+        return format_message(node_id, op_type, action_id, std::string(data));
+    }
+
+    void decode_operand(std::string_view data, bool frame, uint16_t flags, Operand &out, Arena *arena)
+    {
+        if (frame)
+            out.is_sparse = flags & FRAME_SPARSE;
+        else
+            out.is_sparse = !data.empty() && data[0] == '@';
+        if (frame && out.is_sparse)
+            deserialize_sparse_vector_binary(data, flags, out.sparse);
+        else if (frame)
+            out.dense = deserialize_vector_binary(data, flags, arena);
+        else if (out.is_sparse)
+            deserialize_sparse_vector_for_web(data, out.sparse);
+        else
+            out.dense = deserialize_vector_for_web(data, arena);
+        // dot() would fill in the bound lazily; do it before the operand
+        // can be shared between threads
+        if (!out.is_sparse)
+            out.dense.range();
+    }
+
+    // Decodes a GET_A_RESP / GET_B_RESP payload (or half of a TASK) into
+    // `scratch`, or into the cache when the server sent an operand id.
+    // nullptr if the server referred to an operand we do not hold.
+    const Operand *read_operand(std::string_view data, bool frame, uint16_t flags, Operand &scratch, Work &work)
+    {
+        bool cached = frame ? (flags & FRAME_CACHED) : (!data.empty() && data[0] == '=');
+        int id;
+        if (!cached)
+        {
+            decode_operand(data, frame, flags, scratch, &work.arena);
+            return &scratch;
+        }
+        if (!split_cached_operand(data, frame, id, data))
+        {
+            std::cout << "Malformed cached operand. Exiting..." << std::endl;
+            stop = true;
+            return nullptr;
+        }
+        if (data.empty())
+        {
+            std::shared_ptr<Operand> *hit = cache.find(id);
+            if (hit == nullptr)
+            {
+                std::cout << "Operand " << id << " is not cached. Exiting..." << std::endl;
+                stop = true;
+                return nullptr;
+            }
+            work.pinned.push_back(*hit);
+            return hit->get();
+        }
+        std::shared_ptr<Operand> &entry = cache.insert(id);
+        entry = std::make_shared<Operand>();
+        decode_operand(data, frame, flags, *entry, nullptr);
+        work.pinned.push_back(entry);
+        return entry.get();
+    }
+
+    // reads one operand or a block of them into the first (a) or second (b)
+    // side of `work`; false on failure
+    bool read_block(std::string_view data, bool frame, uint16_t flags, bool first, Work &work)
+    {
+        std::vector<Operand> &scratch = first ? work.a : work.b;
+        std::vector<const Operand *> &out = first ? work.op_a : work.op_b;
+        out.clear();
+        bool block = frame ? (flags & FRAME_BLOCK) : data.find('/') != std::string_view::npos;
+        if (!block)
+            parts.assign(1, data);
+        else if (!split_operand_block(data, frame, parts))
+        {
+            std::cout << "Malformed operand block. Exiting..." << std::endl;
+            stop = true;
+            return false;
+        }
+        if (scratch.size() < parts.size())
+            scratch.resize(parts.size());
+        for (size_t k = 0; k < parts.size(); k++)
+        {
+            const Operand *op = read_operand(parts[k], frame, flags, scratch[k], work);
+            if (op == nullptr)
+                return false;
+            out.push_back(op);
+        }
+        return !out.empty();
     }
 
     std::tuple<std::string, std::string> handle_stop(std::string_view &data)
@@ -95,7 +401,7 @@ public:
         {
             this->action_id = got_action_id;
             std::cout << "Successfully entered the network" << std::endl;
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            delay = std::chrono::seconds(1);
             return std::make_tuple("NUDGE", "");
         }
         else
@@ -112,7 +418,7 @@ public:
         if (success)
         {
             std::cout << "Still in the network. Waiting..." << std::endl;
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            delay = std::chrono::seconds(1);
             return std::make_tuple("NUDGE", "");
         }
         else
@@ -126,13 +432,12 @@ public:
     std::tuple<std::string, std::string> handle_assign_action(int got_action_id, std::string_view &data)
     {
         this->action_id = got_action_id;
-        a = Vector();
-        b = Vector();
+        current.reset();
         std::cout << "Assigned action: " << this->action_id << std::endl;
         return std::make_tuple("GET_A", "");
     }
 
-    std::tuple<std::string, std::string> handle_get_a_resp(int got_action_id, std::string_view &data)
+    std::tuple<std::string, std::string> handle_get_a_resp(int got_action_id, std::string_view &data, bool frame, uint16_t flags)
     {
         if (got_action_id != this->action_id)
         {
@@ -142,8 +447,9 @@ public:
         }
 
         // a = Vector().deserialize(std::string(data));
-        a = deserialize_vector_for_web(std::string(data));
-        std::cout << "Received vector A with size: " << a.size << std::endl;
+        if (!read_block(data, frame, flags, true, current))
+            return std::make_tuple("", "");
+        std::cout << "Received " << current.op_a.size() << " vector(s) A with size: " << current.op_a[0]->size() << std::endl;
         // for (int i = 0; i < a.size; i++)
         // {
         //     std::cout << a.get(i) << " ";
@@ -152,7 +458,7 @@ public:
         return std::make_tuple("GET_B", "");
     }
 
-    std::tuple<std::string, std::string> handle_get_b_resp(int got_action_id, std::string_view &data)
+    std::tuple<std::string, std::string> handle_get_b_resp(int got_action_id, std::string_view &data, bool frame, uint16_t flags)
     {
         if (got_action_id != this->action_id)
         {
@@ -162,23 +468,150 @@ public:
         }
 
         // b = Vector().deserialize(std::string(data));
-        b = deserialize_vector_for_web(std::string(data));
-        std::cout << "Received vector B with size: " << b.size << std::endl;
+        if (!read_block(data, frame, flags, false, current))
+            return std::make_tuple("", "");
+        std::cout << "Received " << current.op_b.size() << " vector(s) B with size: " << current.op_b[0]->size() << std::endl;
         // for (int i = 0; i < a.size; i++)
         // {
         //     std::cout << b.get(i) << " ";
         // }
         // std::cout << std::endl;
 
-        long long result = a.dot(b);
-        return std::make_tuple("RETURN", std::to_string(result));
+        return make_return();
+    }
+
+    std::tuple<std::string, std::string> make_return()
+    {
+        current.compute();
+        return std::make_tuple("RETURN", format_results(current.results, binary));
+    }
+
+    // decodes a pushed task (a TASK payload) into `work`
+    bool load_task(Work &work, int got_action_id, std::string_view data, bool frame, uint16_t flags)
+    {
+        std::string_view first, second;
+        if (!split_task_payload(data, frame, first, second))
+        {
+            std::cout << "Malformed task payload. Exiting..." << std::endl;
+            stop = true;
+            return false;
+        }
+        work.action_id = got_action_id;
+        work.reset();
+        return read_block(first, frame, flags, true, work) && read_block(second, frame, flags, false, work);
+    }
+
+    // a single pushed task, when the window is one
+    std::tuple<std::string, std::string> handle_task(int got_action_id, std::string_view &data, bool frame, uint16_t flags)
+    {
+        this->action_id = got_action_id;
+        if (!load_task(current, got_action_id, data, frame, flags))
+            return std::make_tuple("", "");
+        return make_return();
+    }
+
+    // a batch of pushed tasks; they are computed from the event loop
+    std::tuple<std::string, std::string> handle_tasks(std::string_view &data, bool frame, uint16_t flags)
+    {
+        int got_action_id;
+        std::string_view task;
+        while (next_task(data, frame, got_action_id, task))
+        {
+            if (got_action_id == WINDOW_ENTRY)
+                parse_int(task, window);
+            else
+                queued.push_back({got_action_id, frame, flags, std::string(task)});
+        }
+        return std::make_tuple("", "");
+    }
+
+    bool has_work()
+    {
+        return !queued.empty();
+    }
+
+    // Takes the next pushed task and decodes its operands. That has to
+    // happen in arrival order and on the thread that owns the cache (the
+    // server mirrors its evictions); the Work can then be computed anywhere.
+    std::unique_ptr<Work> take_task()
+    {
+        if (queued.empty() || stop)
+            return nullptr;
+        QueuedTask task = std::move(queued.front());
+        queued.pop_front();
+        std::unique_ptr<Work> work;
+        if (spare.empty())
+            work = std::make_unique<Work>();
+        else
+        {
+            work = std::move(spare.back());
+            spare.pop_back();
+        }
+        if (!load_task(*work, task.action_id, task.payload, task.frame, task.flags))
+        {
+            spare.push_back(std::move(work));
+            return nullptr;
+        }
+        in_flight++;
+        return work;
+    }
+
+    void finish_task(std::unique_ptr<Work> work)
+    {
+        append_result(returns, work->action_id, work->results, binary);
+        return_count++;
+        in_flight--;
+        work->reset();
+        spare.push_back(std::move(work));
+    }
+
+    // one pushed task start to finish, on this thread
+    void run_one()
+    {
+        std::unique_ptr<Work> work = take_task();
+        if (work == nullptr)
+            return;
+        work->compute();
+        finish_task(std::move(work));
+    }
+
+    // Results go back half a window at a time, so the other half is still
+    // being computed while the refill is on its way. The server sizes the
+    // window (up to our credits) and sends it with every batch.
+    std::string flush_returns()
+    {
+        if (return_count == 0 || (return_count < std::max(1, window / 2) && (!queued.empty() || in_flight > 0)))
+            return "";
+        std::string message = format("RETURNS", -1, returns);
+        returns.clear();
+        return_count = 0;
+        return message;
     }
 
     std::string message_handler(const std::string &message)
     {
-        auto [node_id_str, op_type, action_id_str, data] = split_message(message);
-        int node_id = std::stoi(std::string(node_id_str));
-        int got_action_id = (action_id_str.size() > 0) ? std::stoi(std::string(action_id_str)) : -1;
+        bool frame = is_frame(message);
+        int got_action_id;
+        uint16_t flags = 0;
+        std::string_view op_type, data;
+        if (frame)
+        {
+            FrameHeader header;
+            if (!split_frame(message, header, data))
+            {
+                std::cout << "Malformed frame of " << message.size() << " bytes" << std::endl;
+                return "";
+            }
+            got_action_id = header.action_id;
+            flags = header.flags;
+            op_type = op_name((MessageOp)header.op);
+        }
+        else
+        {
+            std::string_view node_id_str, action_id_str;
+            std::tie(node_id_str, op_type, action_id_str, data) = split_message(message);
+            got_action_id = (action_id_str.size() > 0) ? std::stoi(std::string(action_id_str)) : -1;
+        }
         std::cout << "Received operation: " << op_type << " of action id " << action_id << " with data length of : " << data.size() << std::endl;
 
         std::string res_op_type = "", res_data = "";
@@ -192,12 +625,16 @@ public:
         else if (op_type == "ASSIGN_ACTION")
             std::tie(res_op_type, res_data) = handle_assign_action(got_action_id, data);
         else if (op_type == "GET_A_RESP")
-            std::tie(res_op_type, res_data) = handle_get_a_resp(got_action_id, data);
+            std::tie(res_op_type, res_data) = handle_get_a_resp(got_action_id, data, frame, flags);
         else if (op_type == "GET_B_RESP")
-            std::tie(res_op_type, res_data) = handle_get_b_resp(got_action_id, data);
+            std::tie(res_op_type, res_data) = handle_get_b_resp(got_action_id, data, frame, flags);
+        else if (op_type == "TASK")
+            std::tie(res_op_type, res_data) = handle_task(got_action_id, data, frame, flags);
+        else if (op_type == "TASKS")
+            std::tie(res_op_type, res_data) = handle_tasks(data, frame, flags);
         else
         {
-            std::cout << "Invalid operation " << op_type << " with data: " << data << std::endl;
+            std::cout << "Invalid operation " << op_type << " with data length of : " << data.size() << std::endl;
         }
 
         if (got_action_id > 0 && got_action_id != this->action_id)
@@ -208,12 +645,7 @@ public:
 
         if (res_op_type == "")
             return "";
-        else
-        {
-            std::string response = format_message(
-                node_id, res_op_type, this->action_id, res_data);
-            return response;
-        }
+        return format(res_op_type, this->action_id, res_data);
     }
 };
 
@@ -254,6 +686,12 @@ public:
 
     void send_message(const std::string &message)
     {
+        if (is_frame(message))
+        {
+            std::cout << "Sending frame of " << message.size() << " bytes" << std::endl;
+            ws->sendBinary(message);
+            return;
+        }
         std::cout << "Sending message: " << message << std::endl;
         ws->send(message);
     }
@@ -264,6 +702,243 @@ public:
     }
 };
 
+// While work is in the pool, the loop waits for it to come back and looks
+// at the socket in between, backing off from 1 ms up to this.
+const int MAX_IDLE_POLL_MS = 16;
+
+// Runs the worker's coroutines on the main thread. A coroutine suspends on
+// receive() until a message arrives, on sleep() for a timer, or on
+// offload() to carry on in the thread pool; back_to_loop() returns it to
+// the loop. The socket and the NodeHandler are only touched from the loop.
+class EventLoop
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    WebSocketManager *manager;
+    ThreadPool *pool;
+
+    EventLoop(WebSocketManager *manager, ThreadPool *pool)
+    {
+        this->manager = manager;
+        this->pool = pool;
+    }
+
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    ~EventLoop()
+    {
+        // frames can go only once no pool thread will resume them
+        while (offloaded > 0)
+            std::this_thread::yield();
+        std::lock_guard<std::mutex> lck(done_mtx);
+        for (coroutine task : tasks)
+            task.destroy();
+    }
+
+    // starts `task` on the next turn of the loop, which owns it from then on
+    void spawn(coroutine task)
+    {
+        tasks.push_back(task);
+        ready.push_back(task);
+    }
+
+    // easywsclient only queues outgoing data, and poll() writes it out, so
+    // there is nothing to wait for
+    void send(const std::string &message)
+    {
+        manager->send_message(message);
+    }
+
+    struct Receive
+    {
+        EventLoop *loop;
+        bool await_ready() { return !loop->inbox.empty(); }
+        void await_suspend(std::coroutine_handle<> handle) { loop->receiver = handle; }
+        std::string await_resume()
+        {
+            std::string message = std::move(loop->inbox.front());
+            loop->inbox.pop_front();
+            return message;
+        }
+    };
+
+    // the next message; one coroutine receives at a time
+    Receive receive()
+    {
+        return Receive{this};
+    }
+
+    struct Sleep
+    {
+        EventLoop *loop;
+        Clock::time_point until;
+        bool await_ready() { return Clock::now() >= until; }
+        void await_suspend(std::coroutine_handle<> handle) { loop->timers.emplace(until, handle); }
+        void await_resume() {}
+    };
+
+    Sleep sleep(Clock::duration duration)
+    {
+        return Sleep{this, Clock::now() + duration};
+    }
+
+    struct Offload
+    {
+        EventLoop *loop;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            loop->offloaded++;
+            loop->pool->submit([handle]()
+                               { handle.resume(); });
+        }
+        void await_resume() {}
+    };
+
+    Offload offload()
+    {
+        return Offload{this};
+    }
+
+    struct BackToLoop
+    {
+        EventLoop *loop;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            // once the handle is queued the loop may resume it and free the
+            // frame this awaiter lives in
+            EventLoop *target = loop;
+            std::lock_guard<std::mutex> lck(target->done_mtx);
+            target->done.push_back(handle);
+            target->offloaded--;
+            target->done_cv.notify_one();
+        }
+        void await_resume() {}
+    };
+
+    BackToLoop back_to_loop()
+    {
+        return BackToLoop{this};
+    }
+
+    // turns the loop until `finished()` or the connection closes
+    template <typename F>
+    void run(F finished)
+    {
+        while (!finished() && !manager->is_closed())
+        {
+            {
+                std::lock_guard<std::mutex> lck(done_mtx);
+                ready.insert(ready.end(), done.begin(), done.end());
+                done.clear();
+            }
+            Clock::time_point now = Clock::now();
+            while (!timers.empty() && timers.begin()->first <= now)
+            {
+                ready.push_back(timers.begin()->second);
+                timers.erase(timers.begin());
+            }
+            while (!ready.empty())
+            {
+                std::coroutine_handle<> handle = ready.front();
+                ready.pop_front();
+                handle.resume();
+            }
+            std::erase_if(tasks, [](coroutine task)
+                          {
+                if (!task.done())
+                    return false;
+                task.destroy();
+                return true; });
+            if (finished())
+                break;
+
+            // block on the socket only while nothing else can wake us. The
+            // pool has no way to interrupt poll(), so with work out the loop
+            // waits on done_cv instead and only peeks at the socket.
+            int timeout = -1;
+            if (!timers.empty())
+                timeout = std::max<long long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(timers.begin()->first - now).count() + 1);
+            if (offloaded > 0)
+            {
+                int wait_ms = (timeout < 0) ? idle_ms : std::min(idle_ms, timeout);
+                std::unique_lock<std::mutex> lck(done_mtx);
+                bool back = done_cv.wait_for(lck, std::chrono::milliseconds(wait_ms), [this]()
+                                             { return !done.empty(); });
+                idle_ms = back ? 1 : std::min(2 * idle_ms, MAX_IDLE_POLL_MS);
+                timeout = 0;
+            }
+            manager->ws->poll(timeout);
+            size_t received = inbox.size();
+            manager->ws->dispatch([this](const std::string &message)
+                                  { inbox.push_back(message); });
+            if (inbox.size() > received)
+                idle_ms = 1;
+            if (receiver && !inbox.empty())
+                ready.push_back(std::exchange(receiver, nullptr));
+        }
+    }
+
+private:
+    std::vector<coroutine> tasks;                 // spawned and not done yet
+    std::deque<std::coroutine_handle<>> ready;    // to resume on this turn
+    std::deque<std::string> inbox;                // received, not taken yet
+    std::coroutine_handle<> receiver;             // waiting in receive()
+    std::multimap<Clock::time_point, std::coroutine_handle<>> timers;
+    std::mutex done_mtx;
+    std::condition_variable done_cv;              // signalled when something is back
+    std::vector<std::coroutine_handle<>> done;    // back from the pool
+    std::atomic<int> offloaded{0};                // running in the pool
+    int idle_ms = 1;                              // next wait while work is out
+};
+
+coroutine compute_task(EventLoop &loop, NodeHandler &handler, std::unique_ptr<Work> work);
+
+// Decodes queued tasks, in arrival order, while the pool has room for them.
+void start_tasks(EventLoop &loop, NodeHandler &handler)
+{
+    while (handler.in_flight < loop.pool->size())
+    {
+        std::unique_ptr<Work> work = handler.take_task();
+        if (work == nullptr)
+            break;
+        loop.spawn(compute_task(loop, handler, std::move(work)));
+    }
+}
+
+// One decoded task: the dot products run in the pool while the loop keeps
+// receiving, and the results are collected back on the loop.
+coroutine compute_task(EventLoop &loop, NodeHandler &handler, std::unique_ptr<Work> work)
+{
+    co_await loop.offload();
+    work->compute();
+    co_await loop.back_to_loop();
+    handler.finish_task(std::move(work));
+    std::string returns = handler.flush_returns();
+    if (returns != "")
+        loop.send(returns);
+    start_tasks(loop, handler);
+}
+
+// Answers the server; pushed batches are queued on the handler and handed
+// to compute_task coroutines.
+coroutine receive_messages(EventLoop &loop, NodeHandler &handler)
+{
+    while (!handler.stop)
+    {
+        std::string message = co_await loop.receive();
+        std::string response = handler.message_handler(message);
+        if (handler.delay.count() > 0)
+            co_await loop.sleep(std::exchange(handler.delay, std::chrono::milliseconds(0)));
+        if (response != "")
+            loop.send(response);
+        start_tasks(loop, handler);
+    }
+}
+
 WebSocketManager manager = WebSocketManager("", 0);
 void signal_handler(int signal)
 {
@@ -298,22 +973,14 @@ int main()
     std::signal(SIGILL, &signal_handler);
     std::signal(SIGTERM, &signal_handler);
 
-    std::string message = format_message(node_id, "ENTER", -1, "");
+    auto [enter_op, enter_data] = handler.make_enter();
+    std::string message = handler.format(enter_op, -1, enter_data);
     manager.send_message(message);
 
-    while (!handler.stop && !manager.is_closed())
-    {
-        manager.ws->poll(-1);
-        manager.ws->dispatch(
-            [&handler](const std::string &message)
-            {
-                std::string response = handler.message_handler(message);
-                if (response != "")
-                {
-                    manager.send_message(response);
-                }
-            });
-    }
+    EventLoop loop(&manager, &defaultPool());
+    loop.spawn(receive_messages(loop, handler));
+    loop.run([&handler]()
+             { return handler.stop; });
 
     return 0;
 }
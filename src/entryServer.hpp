@@ -2,6 +2,13 @@
 #include <queue>
 #include <algorithm>
 #include <random>
+#include <vector>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <mutex>
 #include "App.h"
 
 #ifndef DATA_MODEL_HPP
@@ -10,16 +17,110 @@
 #ifndef MATHLIB_HPP
 #include "utils/mathlib.hpp"
 #endif
+#ifndef STRASSEN_HPP
+#include "utils/strassen.hpp"
+#endif
+#ifndef THREAD_POOL_HPP
+#include "utils/threadPool.hpp"
+#endif
+#ifndef SPARSE_HPP
+#include "utils/sparse.hpp"
+#endif
+#ifndef LRU_CACHE_HPP
+#include "utils/lruCache.hpp"
+#endif
+#ifndef PACKING_HPP
+#include "utils/packing.hpp"
+#endif
 #include <fstream>
 
-std::string serialize_vector_for_web(const Vector &v)
+// Operand serializers append to `out`, which is normally the response
+// being built in the send buffer.
+
+// decimals, each followed by a space
+void serialize_vector_for_web(const Vector &v, std::string &out)
 {
-    std::string s = "";
+    size_t start = out.size();
+    out.resize(start + (size_t)v.size * 12);
+    char *p = out.data() + start;
     for (int i = 0; i < v.size; i++)
     {
-        s += std::to_string(v.data[i]) + " ";
+        p = std::to_chars(p, p + 11, v.data[i]).ptr;
+        *p++ = ' ';
+    }
+    out.resize(p - out.data());
+}
+
+// "@size delta:value delta:value ...", where delta is the gap from the
+// previous stored index (the first one counts from -1)
+void serialize_sparse_vector_for_web(const SparseVector &v, std::string &out)
+{
+    out += '@';
+    append_int(out, v.size);
+    out += ' ';
+    int prev = -1;
+    for (int k = 0; k < v.nnz(); k++)
+    {
+        append_int(out, v.index[k] - prev);
+        out += ':';
+        append_int(out, v.value[k]);
+        out += ' ';
+        prev = v.index[k];
     }
-    return s;
+}
+
+// Raw little-endian payload for binary frames: int16 values when the job
+// flagged FRAME_INT16, int32 otherwise.
+void serialize_vector_binary(const Vector &v, uint16_t flags, std::string &out)
+{
+    if (!(flags & FRAME_INT16))
+    {
+        out.append(reinterpret_cast<const char *>(v.data), (size_t)v.size * sizeof(int32_t));
+        return;
+    }
+    size_t start = out.size();
+    out.resize(start + v.size * sizeof(int16_t));
+    char *p = out.data() + start;
+    for (int i = 0; i < v.size; i++)
+    {
+        int16_t x = v.data[i];
+        std::memcpy(p + i * sizeof(int16_t), &x, sizeof(x));
+    }
+}
+
+// int32 size, then nnz int32 indices, then nnz values as above
+void serialize_sparse_vector_binary(const SparseVector &v, uint16_t flags, std::string &out)
+{
+    append_scalar<int32_t>(out, v.size);
+    out.append(reinterpret_cast<const char *>(v.index.data()), v.nnz() * sizeof(int32_t));
+    if (!(flags & FRAME_INT16))
+    {
+        out.append(reinterpret_cast<const char *>(v.value.data()), v.nnz() * sizeof(int32_t));
+        return;
+    }
+    for (int k = 0; k < v.nnz(); k++)
+        append_scalar<int16_t>(out, v.value[k]);
+}
+
+// FRAME_PACKED: one packed block of the values (see packing.hpp)
+void serialize_vector_packed(const Vector &v, std::string &out)
+{
+    packVector(v.data, v.size, out);
+}
+
+// FRAME_PACKED: int32 size, uint32 nnz, the index gaps as varints (the
+// first one counts from -1), then one packed block of the values
+void serialize_sparse_vector_packed(const SparseVector &v, std::string &out)
+{
+    append_scalar<int32_t>(out, v.size);
+    append_scalar<uint32_t>(out, v.nnz());
+    int prev = -1;
+    for (int k = 0; k < v.nnz(); k++)
+    {
+        putVarint(v.index[k] - prev, out);
+        prev = v.index[k];
+    }
+    packVector(v.value.data(), v.nnz(), out);
 }
 
 int find_from_map(const std::unordered_map<int, int> &m, int val)
@@ -36,11 +137,11 @@ struct StatData
     bool inserting_data;
     bool done;
 
-    int remaining_task_count;
+    long long remaining_task_count;
     int client_count;
     long long elapsed_time;
 
-    StatData(bool booting_up, bool inserting_data, bool done, int remaining_task_count, int client_count, long long elapsed_time)
+    StatData(bool booting_up, bool inserting_data, bool done, long long remaining_task_count, int client_count, long long elapsed_time)
     {
         this->booting_up = booting_up;
         this->inserting_data = inserting_data;
@@ -62,32 +163,179 @@ struct StatData
     }
 };
 
+enum class JobMode
+{
+    DIRECT = 0,   // one masked dot product pair per cell of A * B
+    STRASSEN = 1, // one Strassen-Winograd level: 7 half-size sub-products
+    SPARSE = 2,   // sparse operands, only cells whose supports intersect
+};
+
+// Every cell has up to 4 tasks: PAIRED and SINGLE masking use signs 0-1 and 0,
+// SPARSE uses all four (row sign, col sign) combinations. Task ids only
+// leave room for the signs the job uses.
+const int TASK_VARIANTS = 4;
+
+// Task ids number every variant of every tile of every sub-product, which
+// passes 2^31 at n of about 23k; only results and operands are sent, so
+// the wider id stays on the server.
+typedef long long TaskId;
+
+// Rows (and columns) of A and B a band of tasks covers, whatever the tile;
+// a band's operands fit in a worker's default cache with room to spare.
+const int BAND_VECTORS = 32;
+
+// A lease not returned by its deadline is copied for another node, but
+// stays valid: whichever result comes back first is used. The deadline is
+// a multiple of the node's average turnaround, with a floor.
+const double LEASE_TIMEOUT_FACTOR = 4;
+const int LEASE_TIMEOUT_MIN_MS = 2000;
+const int LEASE_TIMEOUT_FIRST_MS = 30000; // until the node has returned something
+// Once every task is leased and at most this share of results is out,
+// each outstanding lease also gets one copy, for a faster node.
+const double SPECULATE_FRACTION = 0.02;
+
+// Push nodes get as many tasks at a time as they finish in about this long,
+// up to the credits they entered with.
+const int TARGET_LEASE_MS = 500;
+
+// An action id is a random tag (the top 5 bits), a generation and a slot
+// in its node shard's lease table. The generation is never 0, so neither
+// is an id.
+const int LEASE_SLOT_BITS = 18;
+const int LEASE_GENERATION_BITS = 8;
+const int LEASE_SLOT_MASK = (1 << LEASE_SLOT_BITS) - 1;
+const int LEASE_TAG_SHIFT = LEASE_SLOT_BITS + LEASE_GENERATION_BITS;
+
+enum class MaskMode
+{
+    // two tasks per cell, (a+x)(b+y) and (a-x)(b-y); their sum is 2ab + 2xy
+    PAIRED = 0,
+    // one task per cell, (a+x)(b+y); a.y, x.b and x.y are subtracted on the
+    // server, where with SHUFFLE_SIZE masks they are two thin GEMMs
+    SINGLE = 1,
+};
+
 class EntryServerHandler
 {
 public:
-    bool booting_up = true;
+    std::atomic<bool> booting_up = true;
     bool inserting_data = false; // TODO, to keep the queue exploding
-    bool done = false;
+    std::atomic<bool> done = false; // set once the result is final
     std::chrono::time_point<std::chrono::high_resolution_clock> start;
 
-    std::unordered_set<int> node_ids;
-    std::unordered_map<int, int> action_ids; // node_id -> action_id
-    std::unordered_map<int, int> task_info;  // action_id -> task_info
-    std::deque<int> task_queue;
+    struct Lease
+    {
+        int action_id = 0;        // 0 while the slot is free
+        int node_id;
+        int generation = 0;       // bumped every time the slot is reused
+        TaskId task_id;
+        std::chrono::steady_clock::time_point issued, deadline;
+        int window;               // the node's window when it was issued
+        bool timed_out = false;   // copied for any node
+        bool speculated = false;  // copied for a faster node
+    };
+
+    // Several event-loop threads share one handler. Per-node state is split
+    // into shards by node id, each behind its own mutex; a message is
+    // handled with its node's shard locked, so threads only wait on each
+    // other when their nodes share a shard.
+    struct NodeShard
+    {
+        std::mutex mtx;
+        std::unordered_set<int> node_ids;
+        std::unordered_map<int, std::vector<int>> leases; // node_id -> leased action ids, oldest first
+        std::unordered_map<int, int> node_credits;        // node_id -> largest lease window, 1 if absent
+        std::unordered_map<int, int> node_windows;        // node_id -> current lease window, 1 if absent
+        std::vector<Lease> lease_slots;          // indexed by the slot in action ids
+        std::vector<int> free_slots;
+        std::unordered_map<int, double> latency_ms; // node_id -> average lease turnaround, 0 until known
+        std::unordered_set<int> binary_nodes;    // nodes talking in binary frames
+        std::unordered_set<int> push_nodes;      // nodes that entered with PUSH
+        std::unordered_map<int, LruCache<int, char>> node_caches; // operand ids each caching node holds
+        std::unordered_set<int> packed_nodes;    // nodes that entered with PACK
+        std::unordered_map<int, std::pair<int, bool>> walks; // node_id -> (band it takes from, from the back)
+        std::mt19937 g;                          // for action ids
+    };
+
+    // Tasks not leased yet, grouped into bands: a block of BAND_VECTORS
+    // rows by BAND_VECTORS columns of one sub-product, for one sign.
+    // Consecutive tasks of a band share their operands, so a node walks
+    // one band, row by row, until it is empty and then claims the next;
+    // only the order of the bands is random. Once all bands are claimed,
+    // nodes take from the back of bands others are still walking. Band
+    // locks are taken one at a time, never while holding another band's.
+    struct Band
+    {
+        std::mutex mtx;
+        std::vector<TaskId> tasks;
+        size_t next = 0; // tasks[next ..] are left
+    };
+
+    std::vector<std::unique_ptr<NodeShard>> node_shards;
+    std::vector<std::unique_ptr<Band>> bands;
+    std::vector<int> band_order;      // non-empty bands, shuffled
+    std::atomic<int> next_band{0};    // bands claimed so far, in band_order
+    std::atomic<int> steal_from{0};   // where to look for tasks once all are claimed
+    int band_tiles = 1;               // tiles per band, each way
+    int band_rows = 0, band_cols = 0; // bands per sub-product, each way
+    std::atomic<long long> queued{0}; // tasks in all bands
+
+    // Copies of leased tasks, for nodes faster than the holder's
+    // `holder_ms` (any node but the holder if infinite). Handed out once
+    // the bands are empty.
+    struct Copy
+    {
+        TaskId task_id;
+        int holder;
+        double holder_ms;
+    };
+    std::mutex copies_mtx; // taken after a node shard's, never before
+    std::deque<Copy> copies;
+    std::unique_ptr<std::atomic<uint64_t>[]> finished; // a bit per task id, the first result wins
+    std::atomic<int> client_count{0}; // nodes in all node shards
+    std::vector<TaskId> task_queue;   // the job's tasks while set_input_data builds them
+
+    std::array<Vector, 2> random_masks[SHUFFLE_SIZE];        // mask x, y, job_inner long
+    long long random_mask_prods[SHUFFLE_SIZE][SHUFFLE_SIZE]; // x dot y, over the job's inner length
 
-    Vector random_masks[SHUFFLE_SIZE][2];                    // mask x, y
-    long long random_mask_prods[SHUFFLE_SIZE][SHUFFLE_SIZE]; // x dot y
-    int mask_indices[VECTOR_SIZE];
-    Vector a_rows[VECTOR_SIZE][2];
-    Vector b_cols[VECTOR_SIZE][2];
-    Matrix result;
+    // The job is split into product_count independent sub-products of
+    // job_rows x job_inner times job_inner x job_cols. DIRECT has one (A * B),
+    // STRASSEN has the 7 half-size Strassen-Winograd products.
+    JobMode job_mode = JobMode::DIRECT;
+    MaskMode mask_mode = MaskMode::PAIRED;
+    int product_count = 0;
+    int job_rows = 0, job_cols = 0, job_inner = 0;
+    // A task covers a tile x tile block of a sub-product (smaller at the
+    // edges): the worker gets that many rows and columns and returns every
+    // dot product between them.
+    int tile = 1;
+    int row_tiles = 0, col_tiles = 0;
+    int task_variants = TASK_VARIANTS; // signs per tile, see TASK_VARIANTS
+    long long total_task_count = 0;
+    std::atomic<long long> pending_results{0};
+
+    std::vector<int> row_masks;            // [product * job_rows + row] -> mask index
+    std::vector<int> col_masks;            // [product * job_cols + col] -> mask index
+    std::vector<std::array<Vector, 2>> a_rows; // [product * job_rows + row][sign], sign 0 only for SINGLE
+    std::vector<std::array<Vector, 2>> b_cols; // [product * job_cols + col][sign]
+    std::vector<LongMatrix> partials;      // per sub-product accumulators, STRASSEN only
+    // SPARSE only: masks are applied on each vector's own support, so the
+    // operands stay sparse. Summing (a+-x)(b+-y) over all four sign pairs
+    // gives exactly 4ab, with no correction term to compute.
+    std::vector<std::array<SparseVector, 2>> sparse_rows; // [row][sign]
+    std::vector<std::array<SparseVector, 2>> sparse_cols; // [col][sign]
+    Arena operand_arena;                   // backs a_rows and b_cols
+    uint16_t operand_flags = 0;            // frame flags for GET_A_RESP / GET_B_RESP
+    std::vector<std::string> packed_operands; // [operand_id] -> packed payload, "" until first sent
+    std::unique_ptr<std::once_flag[]> packed_once; // [operand_id], guards packed_operands
+    LongMatrix *result = nullptr;          // owned by the caller of set_input_data
 
     std::random_device rd;
     std::mt19937 g;
 
-    std::uniform_int_distribution<int> random_dist;
-
-    EntryServerHandler()
+    // `shards` is the number of node shards, one per hardware thread if
+    // not given
+    EntryServerHandler(int shards = 0)
     {
         booting_up = true;
         inserting_data = false;
@@ -95,224 +343,978 @@ public:
 
         auto seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
         g = std::mt19937(seed);
-        random_dist = std::uniform_int_distribution<int>(1, 1e9);
 
-        // Prepare random masks for Beaver triples
+        if (shards <= 0)
+            shards = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < shards; i++)
+        {
+            node_shards.emplace_back(new NodeShard());
+            node_shards.back()->g = std::mt19937(seed + i);
+            node_shards.back()->lease_slots.reserve(1024);
+        }
+    }
+
+    NodeShard &shard(int node_id)
+    {
+        return *node_shards[(unsigned)node_id % node_shards.size()];
+    }
+
+    TaskId make_task_id(int product, int tile_row, int tile_col, int sign)
+    {
+        return (((TaskId)product * row_tiles + tile_row) * col_tiles + tile_col) * task_variants + sign + 1;
+    }
+    std::tuple<int, int, int, int> unpack_task_id(TaskId task_id)
+    {
+        TaskId zeroed_task_id = task_id - 1;
+        int sign = zeroed_task_id % task_variants;
+        zeroed_task_id /= task_variants;
+        int tile_col = zeroed_task_id % col_tiles;
+        zeroed_task_id /= col_tiles;
+        int tile_row = zeroed_task_id % row_tiles;
+        int product = zeroed_task_id / row_tiles;
+        return std::make_tuple(product, tile_row, tile_col, sign);
+    }
+    // rows [r0, r1) and columns [c0, c1) of a tile
+    std::tuple<int, int, int, int> tile_bounds(int tile_row, int tile_col)
+    {
+        int r0 = tile_row * tile, c0 = tile_col * tile;
+        return std::make_tuple(r0, std::min(job_rows, r0 + tile), c0, std::min(job_cols, c0 + tile));
+    }
+    int band_of(TaskId task_id)
+    {
+        auto [product, tile_row, tile_col, sign] = unpack_task_id(task_id);
+        return ((product * band_rows + tile_row / band_tiles) * band_cols + tile_col / band_tiles) * task_variants + sign;
+    }
+    // whether a tile's columns are sent first (as GET_A)
+    bool tile_swapped(int tile_row, int tile_col)
+    {
+        return (tile_row + tile_col) % 2; // should be pre-determined random
+    }
+    std::tuple<int, int, int, int> unpack_action_id(int node_id, int action_id)
+    {
+        Lease *lease = find_lease(shard(node_id), node_id, action_id);
+        TaskId task_id = (lease == nullptr) ? -1 : lease->task_id;
+        if (task_id <= 0)
+        {
+            std::cerr << "Task ID not found for action ID " << action_id << "!!!" << std::endl;
+            return std::make_tuple(0, 0, 0, 0);
+        }
+        return unpack_task_id(task_id);
+    }
+
+    // the accumulator a sub-product's results are added into
+    LongMatrix &target(int product)
+    {
+        return job_mode == JobMode::STRASSEN ? partials[product] : *result;
+    }
+
+    BasicVectorView<int> mask(int mask_idx, int side)
+    {
+        return BasicVectorView<int>(random_masks[mask_idx][side].data, job_inner);
+    }
+
+    // C = A * B over per-mask products: cell (i, j) of the result is
+    // -(a_i.y_j + x_i.b_j + x_i.y_j) before the worker's (a_i+x_i)(b_j+y_j)
+    // is added
+    void init_single_mask_corrections(int p, const Matrix &L, const Matrix &R)
+    {
+        Matrix mask_x(SHUFFLE_SIZE, job_inner), mask_y(job_inner, SHUFFLE_SIZE);
+        for (int m = 0; m < SHUFFLE_SIZE; m++)
+        {
+            for (int k = 0; k < job_inner; k++)
+            {
+                mask_x.set(m, k, mask(m, 0).get(k));
+                mask_y.set(k, m, mask(m, 1).get(k));
+            }
+        }
+        LongMatrix ay(job_rows, SHUFFLE_SIZE), xb(SHUFFLE_SIZE, job_cols);
+        gemm<long long>(job_rows, SHUFFLE_SIZE, job_inner, L.rowPtr(0), L.stride, mask_y.rowPtr(0), mask_y.stride, ay.rowPtr(0), ay.stride);
+        gemm<long long>(SHUFFLE_SIZE, job_cols, job_inner, mask_x.rowPtr(0), mask_x.stride, R.rowPtr(0), R.stride, xb.rowPtr(0), xb.stride);
+
+        for (int i = 0; i < job_rows; i++)
+        {
+            int row_mask = row_masks[p * job_rows + i];
+            for (int j = 0; j < job_cols; j++)
+            {
+                int col_mask = col_masks[p * job_cols + j];
+                target(p).set(i, j, -(ay.get(i, col_mask) + xb.get(row_mask, j) + random_mask_prods[row_mask][col_mask]));
+            }
+        }
+    }
+
+    // masked dense rows/cols and the per-cell tasks of every sub-product
+    void build_dense_tasks(const Matrix *L, const Matrix *R, int signs)
+    {
+        // apply shuffles to each vectors. The arena is not thread-safe, so
+        // buffers are carved out here and filled in parallel below.
+        a_rows.resize(product_count * job_rows);
+        b_cols.resize(product_count * job_cols);
+        for (auto &v : a_rows)
+            for (int sign = 0; sign < signs; sign++)
+                v[sign] = Vector(job_inner, operand_arena);
+        for (auto &v : b_cols)
+            for (int sign = 0; sign < signs; sign++)
+                v[sign] = Vector(job_inner, operand_arena);
+
+        auto apply_mask = [this, signs](BasicVectorView<int> src, BasicVectorView<int> m, std::array<Vector, 2> &dst)
+        {
+            for (int k = 0; k < job_inner; k++)
+                dst[0].data[k] = src.get(k) + m.get(k);
+            if (signs == 2)
+                for (int k = 0; k < job_inner; k++)
+                    dst[1].data[k] = src.get(k) - m.get(k);
+        };
+        defaultPool().parallelFor(0, product_count * job_rows, 16, [&](int lo, int hi)
+                                  {
+            for (int idx = lo; idx < hi; idx++)
+                apply_mask(L[idx / job_rows].getRow(idx % job_rows), mask(row_masks[idx], 0), a_rows[idx]); });
+        defaultPool().parallelFor(0, product_count * job_cols, 16, [&](int lo, int hi)
+                                  {
+            for (int idx = lo; idx < hi; idx++)
+                apply_mask(R[idx / job_cols].getCol(idx % job_cols), mask(col_masks[idx], 1), b_cols[idx]); });
+
+        // start every cell at its mask correction, then fill task queue
+        for (int p = 0; p < product_count; p++)
+        {
+            if (mask_mode == MaskMode::SINGLE)
+                init_single_mask_corrections(p, L[p], R[p]);
+            else
+                for (int i = 0; i < job_rows; i++)
+                    for (int j = 0; j < job_cols; j++)
+                    {
+                        int row_mask = row_masks[p * job_rows + i], col_mask = col_masks[p * job_cols + j];
+                        target(p).set(i, j, -2 * random_mask_prods[row_mask][col_mask]);
+                    }
+            for (int ti = 0; ti < row_tiles; ti++)
+                for (int tj = 0; tj < col_tiles; tj++)
+                    for (int sign = 0; sign < signs; sign++)
+                        task_queue.push_back(make_task_id(p, ti, tj, sign));
+        }
+    }
+
+    // masked sparse rows/cols, and tasks only for cells where the row of A
+    // and the column of B share an index
+    void build_sparse_tasks(const Matrix &A, const Matrix &B)
+    {
+        SparseMatrix a_csr = SparseMatrix::fromDense(A, SparseLayout::CSR);
+        SparseMatrix b_csc = SparseMatrix::fromDense(B, SparseLayout::CSC);
+
+        sparse_rows.resize(job_rows);
+        sparse_cols.resize(job_cols);
+        auto apply_mask = [this](SparseView src, BasicVectorView<int> m, std::array<SparseVector, 2> &dst)
+        {
+            for (int sign = 0; sign < 2; sign++)
+            {
+                dst[sign].clear(src.size);
+                for (int k = 0; k < src.nnz; k++)
+                    dst[sign].push(src.index[k], sign == 0 ? src.value[k] + m.get(src.index[k]) : src.value[k] - m.get(src.index[k]));
+            }
+        };
+        defaultPool().parallelFor(0, job_rows, 64, [&](int lo, int hi)
+                                  {
+            for (int i = lo; i < hi; i++)
+                apply_mask(a_csr.major(i), mask(row_masks[i], 0), sparse_rows[i]); });
+        defaultPool().parallelFor(0, job_cols, 64, [&](int lo, int hi)
+                                  {
+            for (int j = lo; j < hi; j++)
+                apply_mask(b_csc.major(j), mask(col_masks[j], 1), sparse_cols[j]); });
+
+        // symbolic product: row i of C can only be non-zero at columns
+        // reached through some k in row i of A and row k of B; a tile gets
+        // tasks if any of its cells can
+        SparseMatrix b_csr = b_csc.convert();
+        std::vector<char> hit((size_t)row_tiles * col_tiles, 0);
+        for (int i = 0; i < job_rows; i++)
+        {
+            for (int j = 0; j < job_cols; j++)
+                target(0).set(i, j, 0);
+            SparseView row = a_csr.major(i);
+            for (int p = 0; p < row.nnz; p++)
+            {
+                SparseView b_row = b_csr.major(row.index[p]);
+                for (int q = 0; q < b_row.nnz; q++)
+                    hit[(size_t)(i / tile) * col_tiles + b_row.index[q] / tile] = 1;
+            }
+        }
+        for (int ti = 0; ti < row_tiles; ti++)
+            for (int tj = 0; tj < col_tiles; tj++)
+                if (hit[(size_t)ti * col_tiles + tj])
+                    for (int sign = 0; sign < task_variants; sign++)
+                        task_queue.push_back(make_task_id(0, ti, tj, sign));
+        if (DEBUG)
+            std::cout << "Sparse job: " << a_csr.nnz() << " + " << b_csc.nnz() << " non-zeros, "
+                      << task_queue.size() / task_variants << " of " << (long long)row_tiles * col_tiles << " tiles" << std::endl;
+    }
+
+    void set_input_data(Matrix &A, Matrix &B, LongMatrix &C, JobMode mode = JobMode::DIRECT, MaskMode masking = MaskMode::PAIRED, int tile_size = 1)
+    {
+        // drop the previous job's operands before their memory is reused
+        a_rows.clear();
+        b_cols.clear();
+        sparse_rows.clear();
+        sparse_cols.clear();
+        operand_arena.reset();
+        result = &C;
+        job_mode = mode;
+        mask_mode = masking;
+        int signs = (masking == MaskMode::PAIRED) ? 2 : 1;
+        if (mode == JobMode::SPARSE)
+            mask_mode = MaskMode::PAIRED; // sparse jobs bring their own masking
+        task_variants = (mode == JobMode::SPARSE) ? TASK_VARIANTS : signs;
+
+        Matrix left[STRASSEN_PRODUCTS], right[STRASSEN_PRODUCTS];
+        const Matrix *L = &A, *R = &B;
+        product_count = 1;
+        partials.clear();
+        if (mode == JobMode::STRASSEN)
+        {
+            strassenSplit(A, B, left, right);
+            L = left;
+            R = right;
+            product_count = STRASSEN_PRODUCTS;
+            for (int p = 0; p < product_count; p++)
+            {
+                right[p].cacheColumns();
+                partials.emplace_back(left[p].rows, right[p].cols);
+            }
+        }
+        job_rows = L[0].rows;
+        job_cols = R[0].cols;
+        job_inner = L[0].cols;
+        tile = std::max(1, tile_size);
+        row_tiles = (job_rows + tile - 1) / tile;
+        col_tiles = (job_cols + tile - 1) / tile;
+
+        // Prepare random masks for Beaver triples; mask (i, side) is its own
+        // slice of one counter-based stream, fresh for every job
+        CounterRng mask_rng = nextRng();
         for (int i = 0; i < SHUFFLE_SIZE; i++)
         {
-            random_masks[i][0] = Vector(VECTOR_SIZE);
-            randomVector(random_masks[i][0]);
-            random_masks[i][1] = Vector(VECTOR_SIZE);
-            randomVector(random_masks[i][1]);
+            for (int side = 0; side < 2; side++)
+            {
+                random_masks[i][side] = Vector(job_inner);
+                mask_rng.fill((uint64_t)(2 * i + side) * job_inner, random_masks[i][side].data, job_inner, 0, MAX_VALUE - 1);
+                random_masks[i][side].bound = MAX_VALUE - 1;
+            }
         }
+
         // offset for Beaver triples
         for (int i = 0; i < SHUFFLE_SIZE; i++)
             for (int j = 0; j < SHUFFLE_SIZE; j++)
-                random_mask_prods[i][j] = random_masks[i][0].dot(random_masks[j][1]);
+                random_mask_prods[i][j] = mask(i, 0).dot(mask(j, 1));
 
         // Allocate random indices for each row/col vectors
-        for (int i = 0; i < VECTOR_SIZE; i++)
+        row_masks.resize(product_count * job_rows);
+        col_masks.resize(product_count * job_cols);
+        CounterRng index_rng = nextRng();
+        index_rng.fill(0, row_masks.data(), row_masks.size(), 0, SHUFFLE_SIZE - 1);
+        index_rng.fill(row_masks.size(), col_masks.data(), col_masks.size(), 0, SHUFFLE_SIZE - 1);
+
+        if (mode == JobMode::SPARSE)
+            build_sparse_tasks(A, B);
+        else
+            build_dense_tasks(L, R, signs);
+        operand_flags = (mode == JobMode::SPARSE ? FRAME_SPARSE : 0) | (operand_bound() <= INT16_MAX ? FRAME_INT16 : 0) |
+                        (tile > 1 ? FRAME_BLOCK : 0);
+
+        int operand_count = operand_id(false, mode == JobMode::SPARSE ? sparse_cols.size() : b_cols.size(), 0);
+        packed_operands.assign(operand_count, std::string());
+        packed_once.reset(new std::once_flag[operand_count]);
+
+        total_task_count = task_queue.size();
+        pending_results = total_task_count;
+
+        // tasks were built row-major, and stay that way within a band;
+        // shuffle the bands
+        band_tiles = std::max(1, BAND_VECTORS / tile);
+        band_rows = (row_tiles + band_tiles - 1) / band_tiles;
+        band_cols = (col_tiles + band_tiles - 1) / band_tiles;
+        bands.clear();
+        for (int k = 0; k < product_count * band_rows * band_cols * task_variants; k++)
+            bands.emplace_back(new Band());
+        for (TaskId task_id : task_queue)
+            bands[band_of(task_id)]->tasks.push_back(task_id);
+        band_order.clear();
+        for (size_t k = 0; k < bands.size(); k++)
+            if (!bands[k]->tasks.empty())
+                band_order.push_back(k);
+        std::shuffle(band_order.begin(), band_order.end(), g);
+        next_band = 0;
+        steal_from = 0;
+        queued = total_task_count;
+        task_queue.clear();
+        task_queue.shrink_to_fit();
+        copies.clear();
+        finished.reset(new std::atomic<uint64_t>[make_task_id(product_count, 0, 0, 0) / 64 + 1]());
+
+        if (DEBUG)
+            std::cout << "Task queue size: " << total_task_count << " in " << band_order.size() << " bands" << std::endl;
+        if (total_task_count == 0)
+            finish_job();
+    }
+
+    // largest |value| any worker will be sent for this job
+    int operand_bound()
+    {
+        int bound = 0;
+        for (auto &side : {&a_rows, &b_cols})
+            for (auto &signs : *side)
+                for (auto &v : signs)
+                    bound = std::max(bound, v.range());
+        for (auto &side : {&sparse_rows, &sparse_cols})
+            for (auto &signs : *side)
+                for (auto &v : signs)
+                    bound = std::max(bound, maxAbs(v.value.data(), v.nnz()));
+        return bound;
+    }
+
+    // called once the last result is in
+    void finish_job()
+    {
+        // paired tasks add up to twice the product, sparse ones to 4 times
+        int scale = (job_mode == JobMode::SPARSE) ? 4 : (mask_mode == MaskMode::PAIRED) ? 2 : 1;
+        if (scale > 1)
+            for (int p = 0; p < product_count; p++)
+                for (int i = 0; i < job_rows; i++)
+                    for (int j = 0; j < job_cols; j++)
+                        target(p).set(i, j, target(p).get(i, j) / scale);
+        if (job_mode == JobMode::STRASSEN)
+            strassenJoin(partials.data(), *result);
+        done = true;
+    }
+
+    // the next task of a band, -1 if it is empty
+    TaskId pop_task(int band, bool from_back)
+    {
+        Band &b = *bands[band];
+        std::lock_guard<std::mutex> lck(b.mtx);
+        if (b.next == b.tasks.size())
+            return -1;
+        TaskId task_id;
+        if (from_back)
+        {
+            task_id = b.tasks.back();
+            b.tasks.pop_back();
+        }
+        else
+            task_id = b.tasks[b.next++];
+        queued--;
+        return task_id;
+    }
+
+    // a band that still has tasks, -1 if none does
+    int find_band()
+    {
+        int count = band_order.size();
+        int start = steal_from.load(std::memory_order_relaxed);
+        for (int k = 0; k < count && queued.load(std::memory_order_relaxed) > 0; k++)
         {
-            mask_indices[i] = random_dist(g) % SHUFFLE_SIZE;
+            int at = (start + k) % count;
+            Band &b = *bands[band_order[at]];
+            std::lock_guard<std::mutex> lck(b.mtx);
+            if (b.next < b.tasks.size())
+            {
+                steal_from.store(at, std::memory_order_relaxed);
+                return band_order[at];
+            }
         }
+        return -1;
     }
 
-    int make_task_id(int row_idx, int col_idx, int sign)
+    bool is_finished(TaskId task_id)
     {
-        return (row_idx * VECTOR_SIZE + col_idx) * 2 + sign + 1;
+        return finished[task_id >> 6] & (1ULL << (task_id & 63));
     }
-    std::tuple<int, int, int> unpack_action_id(int action_id)
+
+    // false if a result for the task was already in
+    bool mark_finished(TaskId task_id)
     {
-        int zeroed_task_id = find_from_map(task_info, action_id) - 1;
-        if (zeroed_task_id < 0)
+        uint64_t bit = 1ULL << (task_id & 63);
+        return !(finished[task_id >> 6].fetch_or(bit) & bit);
+    }
+
+    void return_task(TaskId task_id)
+    {
+        Band &b = *bands[band_of(task_id)];
+        std::lock_guard<std::mutex> lck(b.mtx);
+        b.tasks.push_back(task_id);
+        queued++;
+    }
+
+    // a copy this node may run, -1 if there is none
+    TaskId take_copy(int node_id, double node_ms)
+    {
+        std::lock_guard<std::mutex> lck(copies_mtx);
+        for (size_t k = 0; k < copies.size();)
         {
-            std::cerr << "Task ID not found for action ID " << action_id << "!!!" << std::endl;
-            return std::make_tuple(0, 0, 0);
+            Copy &copy = copies[k];
+            if (is_finished(copy.task_id))
+            {
+                copies.erase(copies.begin() + k);
+                continue;
+            }
+            bool faster = std::isinf(copy.holder_ms) || (node_ms > 0 && node_ms < copy.holder_ms);
+            if (copy.holder != node_id && faster)
+            {
+                TaskId task_id = copy.task_id;
+                copies.erase(copies.begin() + k);
+                return task_id;
+            }
+            k++;
         }
-        int sign = zeroed_task_id % 2;
-        zeroed_task_id /= 2;
-        int col_idx = zeroed_task_id % VECTOR_SIZE;
-        int row_idx = zeroed_task_id / VECTOR_SIZE;
-        return std::make_tuple(row_idx, col_idx, sign);
+        return -1;
+    }
+
+    // Called every so often. Leases past their deadline get a copy any
+    // node may take. Near the end of the job, every outstanding lease gets
+    // one copy for a faster node, so the last results come from the
+    // fastest nodes rather than the slowest.
+    void check_leases()
+    {
+        if (booting_up || done)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        bool tail = queued == 0 && pending_results <= std::max(1.0, total_task_count * SPECULATE_FRACTION);
+        std::vector<Copy> found;
+        for (auto &shard : node_shards)
+        {
+            std::lock_guard<std::mutex> lck(shard->mtx);
+            for (auto &[node_id, leased] : shard->leases)
+                for (int action_id : leased)
+                {
+                    Lease &lease = *find_lease(*shard, node_id, action_id);
+                    if (is_finished(lease.task_id) || lease.timed_out)
+                        continue;
+                    if (now > lease.deadline)
+                    {
+                        lease.timed_out = true;
+                        found.push_back({lease.task_id, node_id, INFINITY});
+                    }
+                    else if (tail && !lease.speculated)
+                    {
+                        lease.speculated = true;
+                        double ms = find_latency(*shard, node_id);
+                        found.push_back({lease.task_id, node_id, ms > 0 ? ms : INFINITY});
+                    }
+                }
+        }
+        if (found.empty())
+            return;
+        if (DEBUG)
+            std::cout << "Copying " << found.size() << " outstanding task(s)" << std::endl;
+        std::lock_guard<std::mutex> lck(copies_mtx);
+        copies.insert(copies.end(), found.begin(), found.end());
+    }
+
+    double find_latency(NodeShard &node, int node_id)
+    {
+        auto it = node.latency_ms.find(node_id);
+        return it == node.latency_ms.end() ? 0 : it->second;
     }
 
-    void set_input_data(Matrix &A, Matrix &B, Matrix &C)
+    // the methods below expect the node's shard to be locked
+
+    // The node's lease for an action id, nullptr if there is none. Ids of
+    // finished leases stop matching once their slot is reused, since the
+    // generation (or the tag) differs.
+    Lease *find_lease(NodeShard &node, int node_id, int action_id)
     {
-        // apply shuffles to each vectors
-        for (int i = 0; i < A.rows; i++)
+        int slot = action_id & LEASE_SLOT_MASK;
+        if (action_id <= 0 || slot >= (int)node.lease_slots.size())
+            return nullptr;
+        Lease &lease = node.lease_slots[slot];
+        if (lease.action_id != action_id || lease.node_id != node_id)
+            return nullptr;
+        return &lease;
+    }
+
+    // a free slot with a fresh action id, nullptr if the table is full
+    Lease *open_lease(NodeShard &node, int node_id)
+    {
+        int slot;
+        if (!node.free_slots.empty())
         {
-            int mask_idx = mask_indices[i];
-            a_rows[i][0] = A.getRow(i) + random_masks[mask_idx][0];
-            a_rows[i][1] = A.getRow(i) - random_masks[mask_idx][0];
+            slot = node.free_slots.back();
+            node.free_slots.pop_back();
         }
-        for (int i = 0; i < B.cols; i++)
+        else if (node.lease_slots.size() <= LEASE_SLOT_MASK)
         {
-            int mask_idx = mask_indices[i];
-            b_cols[i][0] = B.getCol(i) + random_masks[mask_idx][1];
-            b_cols[i][1] = B.getCol(i) - random_masks[mask_idx][1];
+            slot = node.lease_slots.size();
+            node.lease_slots.emplace_back();
         }
-        result = C;
+        else
+            return nullptr;
+        Lease &lease = node.lease_slots[slot];
+        int generation = lease.generation % ((1 << LEASE_GENERATION_BITS) - 1) + 1;
+        int tag = node.g() >> (32 - (31 - LEASE_TAG_SHIFT));
+        lease = Lease();
+        lease.generation = generation;
+        lease.action_id = (tag << LEASE_TAG_SHIFT) | (generation << LEASE_SLOT_BITS) | slot;
+        lease.node_id = node_id;
+        return &lease;
+    }
+
+    void close_lease(NodeShard &node, Lease &lease)
+    {
+        node.free_slots.push_back(lease.action_id & LEASE_SLOT_MASK);
+        lease.action_id = 0;
+    }
 
-        // fill task queue
-        for (int i = 0; i < A.rows; i++)
+    // The next task of the band the node walks. When that is empty, the
+    // node claims the next band, or once all are claimed, joins one that
+    // still has tasks from the back.
+    TaskId take_task(int node_id)
+    {
+        if (queued.load(std::memory_order_relaxed) == 0)
+            return take_copy(node_id, find_latency(shard(node_id), node_id));
+        auto &walks = shard(node_id).walks;
+        auto it = walks.find(node_id);
+        if (it != walks.end())
+        {
+            TaskId task_id = pop_task(it->second.first, it->second.second);
+            if (task_id != -1)
+                return task_id;
+        }
+        while (queued.load(std::memory_order_relaxed) > 0)
         {
-            for (int j = 0; j < B.cols; j++)
+            std::pair<int, bool> walk(-1, false);
+            if (next_band.load(std::memory_order_relaxed) < (int)band_order.size())
             {
-                result.set(i, j, -2 * random_mask_prods[mask_indices[i]][mask_indices[j]]);
-                task_queue.push_back(make_task_id(i, j, 0));
-                task_queue.push_back(make_task_id(i, j, 1));
+                int claimed = next_band++;
+                if (claimed < (int)band_order.size())
+                    walk.first = band_order[claimed];
             }
+            if (walk.first == -1)
+                walk = std::make_pair(find_band(), true);
+            if (walk.first == -1)
+                break;
+            walks[node_id] = walk;
+            TaskId task_id = pop_task(walk.first, walk.second);
+            if (task_id != -1)
+                return task_id;
         }
+        return take_copy(node_id, find_latency(shard(node_id), node_id));
+    }
 
-        // shuffle task queue
-        std::shuffle(task_queue.begin(), task_queue.end(), g);
+    int assign_single_task(int node_id)
+    {
+        // tasks handed back on CLOSE may have been finished by a copy since
+        TaskId task_id;
+        do
+            task_id = take_task(node_id);
+        while (task_id != -1 && is_finished(task_id));
+        if (task_id == -1)
+            return -1;
 
-        if (DEBUG)
-            std::cout << "Task queue size: " << task_queue.size() << std::endl;
+        NodeShard &node = shard(node_id);
+        Lease *lease = open_lease(node, node_id);
+        if (lease == nullptr)
+        {
+            std::cerr << "Lease table is full!!!" << std::endl;
+            return_task(task_id);
+            return -1;
+        }
+        lease->task_id = task_id;
+        lease->issued = std::chrono::steady_clock::now();
+        double ms = find_latency(node, node_id);
+        ms = (ms > 0) ? std::max<double>(LEASE_TIMEOUT_MIN_MS, LEASE_TIMEOUT_FACTOR * ms) : LEASE_TIMEOUT_FIRST_MS;
+        lease->deadline = lease->issued + std::chrono::microseconds((long long)(ms * 1000));
+        lease->window = lease_window(node_id);
+        node.leases[node_id].push_back(lease->action_id);
+        // std::cout << "Assigned task " << lease->action_id << " - " << task_id << " to client " << node_id << std::endl;
+
+        return lease->action_id;
     }
 
-    int assign_single_task(int node_id)
+    // the oldest action leased to the node; the only one unless it has a window
+    int current_action(int node_id)
     {
-        if (task_queue.size() == 0)
+        auto &leases = shard(node_id).leases;
+        auto it = leases.find(node_id);
+        if (it == leases.end() || it->second.empty())
             return -1;
+        return it->second.front();
+    }
 
-        // while (task_queue.front() == 0)
-        // {
-        //     std::cerr << "Task ID 0 is found in the queue!!!" << std::endl;
-        //     std::cerr << "Task queue size: " << task_queue.size() << std::endl;
-        //     task_queue.pop_front();
-        // }
+    int credits(int node_id)
+    {
+        return std::max(1, find_from_map(shard(node_id).node_credits, node_id));
+    }
 
-        int task_id = task_queue.front();
-        task_queue.pop_front();
-        int action_id = random_dist(g);
+    int lease_window(int node_id)
+    {
+        return std::max(1, find_from_map(shard(node_id).node_windows, node_id));
+    }
 
-        action_ids[node_id] = action_id;
-        task_info[action_id] = task_id;
-        // std::cout << "Assigned task " << action_ids[node_id] << " - " << task_info[action_id] << " to client " << node_id << std::endl;
+    // A lease's turnaround is about window / rate + RTT, so scaling the
+    // window by target / turnaround heads for TARGET_LEASE_MS of work per
+    // node. Nodes that finish fast relative to their RTT get deeper
+    // windows; ones slower than the target are brought down to one task.
+    // The window at most doubles or halves per result.
+    void resize_window(NodeShard &node, int node_id, int window, double turnaround_ms)
+    {
+        int cap = credits(node_id);
+        if (cap == 1)
+            return;
+        int current = lease_window(node_id);
+        double wanted = window * TARGET_LEASE_MS / std::max(turnaround_ms, 0.01);
+        int next = std::clamp((int)std::lround(wanted), std::max(1, current / 2), current * 2);
+        node.node_windows[node_id] = std::min(next, cap);
+    }
+
+    // Adds a leased action's results, row-major over the tile as the worker
+    // saw it (columns first if the tile was swapped); false if the node
+    // does not hold the action or sent the wrong number of results. Tasks
+    // of the same cell can finish on different threads, so the adds are
+    // atomic; results for a task a copy already finished are dropped.
+    bool complete_action(int node_id, int action_id, const std::vector<long long> &results)
+    {
+        NodeShard &node = shard(node_id);
+        Lease *lease = find_lease(node, node_id, action_id);
+        if (lease == nullptr)
+        {
+            std::cerr << "Action ID " << action_id << " is not leased to client " << node_id << "!!!" << std::endl;
+            return false;
+        }
+        TaskId task_id = lease->task_id;
+        auto [product, tile_row, tile_col, sign] = unpack_task_id(task_id);
+        auto [r0, r1, c0, c1] = tile_bounds(tile_row, tile_col);
+        if (results.size() != (size_t)(r1 - r0) * (c1 - c0))
+        {
+            std::cerr << "Got " << results.size() << " results for action ID " << action_id << " from client " << node_id << "!!!" << std::endl;
+            return false;
+        }
+        auto &leased = node.leases[node_id];
+        leased.erase(std::find(leased.begin(), leased.end(), action_id));
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - lease->issued).count();
+        double &average = node.latency_ms[node_id];
+        average = (average == 0) ? ms : 0.8 * average + 0.2 * ms;
+        resize_window(node, node_id, lease->window, average);
+        close_lease(node, *lease);
+        if (!mark_finished(task_id))
+            return true;
 
-        return action_id;
+        // on top of the correction from set_input_data
+        bool swap = tile_swapped(tile_row, tile_col);
+        for (int i = r0; i < r1; i++)
+            for (int j = c0; j < c1; j++)
+                target(product).atomicAdd(i, j, swap ? results[(j - c0) * (r1 - r0) + (i - r0)] : results[(i - r0) * (c1 - c0) + (j - c0)]);
+        if (--pending_results == 0)
+            finish_job();
+        return true;
     }
 
-    std::tuple<std::string, std::string> handle_enter(int node_id, std::string_view &data)
+    MessageOp handle_enter(int node_id, std::string_view data, std::string &out)
     {
-        if (node_ids.count(node_id) > 0)
+        NodeShard &node = shard(node_id);
+        if (node.node_ids.count(node_id) > 0)
         {
             std::cout << "Client id " + std::to_string(node_id) + " is already taken.\n";
-            return std::make_tuple("ENTER_RESP", "0");
+            out += '0';
+            return MessageOp::ENTER_RESP;
         }
 
-        node_ids.insert(node_id);
+        node.node_ids.insert(node_id);
+        client_count++;
+        EnterOptions options = EnterOptions::parse(data);
+        if (options.push)
+            node.push_nodes.insert(node_id);
+        if (options.credits > 1)
+            node.node_credits[node_id] = options.credits;
+        if (options.cache > 0)
+            node.node_caches.emplace(node_id, LruCache<int, char>(options.cache));
+        if (options.pack)
+            node.packed_nodes.insert(node_id);
 
         std::cout << "Client id " + std::to_string(node_id) + " is connected.\n";
 
+        out += '1';
         if (booting_up)
         {
             std::cout << "Currently booting up!\n";
-            action_ids[node_id] = -1;
-            return std::make_tuple("ENTER_RESP", "1");
+            return MessageOp::ENTER_RESP;
         }
         else
         {
             int action_id = assign_single_task(node_id);
-            if (DEBUG)
-                std::cout << "Assigned task " << action_id << " to client " << node_id << std::endl;
+            if (TRACE_MESSAGES)
+                std::cout << "Assigned task " << action_id << " to client " << node_id << '\n';
             if (action_id == -1)
             {
-                return std::make_tuple("ENTER_RESP", "1");
+                return MessageOp::ENTER_RESP;
             }
-            return std::make_tuple("ASSIGN_ACTION", "1");
+            return MessageOp::ASSIGN_ACTION;
         }
     }
 
-    std::tuple<std::string, std::string> handle_close(int node_id, std::string_view &data)
+    MessageOp handle_close(int node_id, std::string_view data, std::string &out)
     {
-        if (node_ids.count(node_id) == 0)
+        NodeShard &node = shard(node_id);
+        if (node.node_ids.count(node_id) == 0)
         {
             if (DEBUG)
                 std::cout << "Client id " + std::to_string(node_id) + " is not found.\n";
-            return std::make_tuple("ENTER_RESP", "0");
+            out += '0';
+            return MessageOp::ENTER_RESP;
         }
 
-        int ongoing_action_id = find_from_map(action_ids, node_id);
-        if (ongoing_action_id > 0)
+        // hand every unfinished lease back to the queue
+        for (int action_id : node.leases[node_id])
         {
-            task_queue.push_back(ongoing_action_id);
-            task_info.erase(ongoing_action_id);
+            Lease &lease = *find_lease(node, node_id, action_id);
+            if (!is_finished(lease.task_id))
+                return_task(lease.task_id);
+            close_lease(node, lease);
         }
-        action_ids.erase(node_id);
-        node_ids.erase(node_id);
-        return std::make_tuple("ENTER_RESP", "1");
+        node.leases.erase(node_id);
+        node.node_credits.erase(node_id);
+        node.node_windows.erase(node_id);
+        node.walks.erase(node_id);
+        node.latency_ms.erase(node_id);
+        node.node_ids.erase(node_id);
+        client_count--;
+        node.binary_nodes.erase(node_id);
+        node.push_nodes.erase(node_id);
+        node.node_caches.erase(node_id);
+        node.packed_nodes.erase(node_id);
+        out += '1';
+        return MessageOp::ENTER_RESP;
     }
 
-    std::tuple<std::string, std::string> handle_nudge(int node_id, std::string_view &data)
+    MessageOp handle_nudge(int node_id, std::string_view data, std::string &out)
     {
+        out += '1';
         if (booting_up)
         {
-            if (DEBUG)
+            if (TRACE_MESSAGES)
                 std::cout << "Still booting up!\n";
-            return std::make_tuple("NUDGE_RESP", "1");
+            return MessageOp::NUDGE_RESP;
         }
         else
         {
             int action_id = assign_single_task(node_id);
-            if (DEBUG)
-                std::cout << "Assigned task " << action_id << " to client " << node_id << std::endl;
+            if (TRACE_MESSAGES)
+                std::cout << "Assigned task " << action_id << " to client " << node_id << '\n';
             if (action_id == -1)
             {
-                return std::make_tuple("NUDGE_RESP", "1");
+                return done ? MessageOp::STOP : MessageOp::NUDGE_RESP;
             }
-            return std::make_tuple("ASSIGN_ACTION", "1");
+            return MessageOp::ASSIGN_ACTION;
         }
     }
 
-    std::tuple<std::string, std::string> handle_get_a(int node_id, std::string_view &data)
+    // Nodes out of tasks are not stopped before the job is done: copies of
+    // late tasks may still come up for them.
+    MessageOp no_task(std::string &out)
+    {
+        if (done)
+            return MessageOp::STOP;
+        out += '1';
+        return MessageOp::NUDGE_RESP;
+    }
+
+    // stable id of an operand vector for the job: rows first, then
+    // columns, two signs each
+    int operand_id(bool row, int index, int sign)
+    {
+        int rows = (job_mode == JobMode::SPARSE) ? sparse_rows.size() : a_rows.size();
+        return ((row ? 0 : rows) + index) * 2 + sign;
+    }
+
+    // the node's cache mirror, if it can hold all operands of a task at once
+    LruCache<int, char> *held_operands(int node_id)
+    {
+        auto &node_caches = shard(node_id).node_caches;
+        auto cache = node_caches.find(node_id);
+        if (cache == node_caches.end() || cache->second.getCapacity() < 2 * (size_t)tile)
+            return nullptr;
+        return &cache->second;
+    }
+
+    // The operands of an action sent for GET_A (first) or GET_B (second):
+    // one vector, or a block of them for tiled jobs. Nodes with a cache
+    // big enough for a whole task get ids, and vectors only where their
+    // cache does not hold them yet.
+    void serialize_operand(int node_id, int action_id, bool binary, bool first, std::string &out)
+    {
+        auto [product, tile_row, tile_col, sign] = unpack_action_id(node_id, action_id);
+        auto [r0, r1, c0, c1] = tile_bounds(tile_row, tile_col);
+        bool send_row = (first != tile_swapped(tile_row, tile_col));
+        bool sparse = (job_mode == JobMode::SPARSE);
+        int base = sparse ? 0 : product * (send_row ? job_rows : job_cols);
+        int vector_sign = sparse ? (send_row ? sign & 1 : sign >> 1) : sign;
+
+        LruCache<int, char> *held = held_operands(node_id);
+        bool packed = binary && shard(node_id).packed_nodes.count(node_id) > 0;
+        if (tile == 1)
+            return serialize_vector_operand(held, send_row, base + (send_row ? r0 : c0), vector_sign, binary, packed, out);
+        int lo = send_row ? r0 : c0, hi = send_row ? r1 : c1;
+        begin_operand_block(out, hi - lo, binary);
+        for (int k = lo; k < hi; k++)
+        {
+            size_t start = begin_block_operand(out, k - lo, binary);
+            serialize_vector_operand(held, send_row, base + k, vector_sign, binary, packed, out);
+            end_block_operand(out, start, binary);
+        }
+    }
+
+    void serialize_vector_operand(LruCache<int, char> *held, bool send_row, int index, int vector_sign, bool binary, bool packed, std::string &out)
+    {
+        bool sparse = (job_mode == JobMode::SPARSE);
+        int id = operand_id(send_row, index, vector_sign);
+        if (held != nullptr)
+        {
+            bool hit = held->touch(id);
+            append_cached_id(out, id, !hit, binary);
+            if (hit)
+                return;
+        }
+
+        if (packed)
+            out += packed_operand(id, send_row, index, vector_sign);
+        else if (sparse)
+        {
+            const SparseVector &v = send_row ? sparse_rows[index][vector_sign] : sparse_cols[index][vector_sign];
+            if (binary)
+                serialize_sparse_vector_binary(v, operand_flags, out);
+            else
+                serialize_sparse_vector_for_web(v, out);
+        }
+        else
+        {
+            const Vector &v = send_row ? a_rows[index][vector_sign] : b_cols[index][vector_sign];
+            if (binary)
+                serialize_vector_binary(v, operand_flags, out);
+            else
+                serialize_vector_for_web(v, out);
+        }
+    }
+
+    // Packing costs more than copying, and the same operand goes out to
+    // many tasks, so each one is packed once per job, by whichever thread
+    // sends it first.
+    const std::string &packed_operand(int id, bool send_row, int index, int vector_sign)
+    {
+        std::string &operand = packed_operands[id];
+        std::call_once(packed_once[id], [&]()
+                       {
+            if (job_mode == JobMode::SPARSE)
+                serialize_sparse_vector_packed(send_row ? sparse_rows[index][vector_sign] : sparse_cols[index][vector_sign], operand);
+            else
+                serialize_vector_packed(send_row ? a_rows[index][vector_sign] : b_cols[index][vector_sign], operand); });
+        return operand;
+    }
+
+    void serialize_task(int node_id, int action_id, bool binary, std::string &out)
+    {
+        size_t start = begin_task_payload(out, binary);
+        serialize_operand(node_id, action_id, binary, true, out);
+        end_first_operand(out, start, binary);
+        serialize_operand(node_id, action_id, binary, false, out);
+    }
+
+    // For push nodes: leases more tasks until the node's window is full,
+    // and sends `leased` (if not -1) along with the new ones. Nodes that
+    // entered without credits get a plain TASK; batches start with the
+    // window. Like the node's returns, refills come half a window at a
+    // time. INVALID when there is nothing new to send.
+    MessageOp make_tasks(int node_id, int leased, std::string &out)
     {
-        auto [row_idx, col_idx, sign] = unpack_action_id(find_from_map(action_ids, node_id));
-        bool swap = (row_idx + col_idx) % 2; // should be pre-determined random
-        std::string serialized_a = serialize_vector_for_web(swap ? b_cols[col_idx][sign] : a_rows[row_idx][sign]);
-        return std::make_tuple("GET_A_RESP", serialized_a);
+        NodeShard &node = shard(node_id);
+        auto &node_leases = node.leases[node_id];
+        int window = lease_window(node_id);
+        bool batched = credits(node_id) > 1;
+        if (leased == -1 && (int)node_leases.size() > window / 2)
+            return MessageOp::INVALID;
+        bool binary = node.binary_nodes.count(node_id) > 0;
+        size_t empty = out.size();
+        int sent = 0;
+        auto send = [&](int action_id)
+        {
+            if (!batched)
+                serialize_task(node_id, action_id, binary, out);
+            else
+            {
+                size_t start = begin_task(out, action_id, binary);
+                serialize_task(node_id, action_id, binary, out);
+                end_task(out, start, binary);
+            }
+            sent++;
+        };
+        if (batched)
+        {
+            size_t start = begin_task(out, WINDOW_ENTRY, binary);
+            append_int(out, window);
+            end_task(out, start, binary);
+        }
+        if (leased != -1)
+            send(leased);
+        while ((int)node_leases.size() < window)
+        {
+            int action_id = assign_single_task(node_id);
+            if (action_id == -1)
+                break;
+            send(action_id);
+        }
+        if (sent == 0)
+        {
+            out.resize(empty);
+            return node_leases.empty() ? no_task(out) : MessageOp::INVALID;
+        }
+        return batched ? MessageOp::TASKS : MessageOp::TASK;
     }
 
-    std::tuple<std::string, std::string> handle_get_b(int node_id, std::string_view &data)
+    MessageOp handle_get_a(int node_id, std::string_view data, std::string &out)
     {
-        auto [row_idx, col_idx, sign] = unpack_action_id(find_from_map(action_ids, node_id));
-        bool swap = (row_idx + col_idx) % 2; // should be pre-determined random
-        std::string serialized_b = serialize_vector_for_web(swap ? a_rows[row_idx][sign] : b_cols[col_idx][sign]);
-        return std::make_tuple("GET_B_RESP", serialized_b);
+        serialize_operand(node_id, current_action(node_id), shard(node_id).binary_nodes.count(node_id) > 0, true, out);
+        return MessageOp::GET_A_RESP;
     }
 
-    std::tuple<std::string, std::string> handle_return(int node_id, std::string_view &data)
+    MessageOp handle_get_b(int node_id, std::string_view data, std::string &out)
     {
-        int action_id = find_from_map(action_ids, node_id);
-        auto [row_idx, col_idx, sign] = unpack_action_id(action_id);
-        long long got_result = std::stoll(std::string(data));
-        // long long did_result = a_rows[row_idx][sign].dot(b_cols[col_idx][sign]); // expected result
+        serialize_operand(node_id, current_action(node_id), shard(node_id).binary_nodes.count(node_id) > 0, false, out);
+        return MessageOp::GET_B_RESP;
+    }
 
-        result.add(row_idx, col_idx, got_result); // result[row][col] = (a-x)(b-y) + (a+y)(b+x) - 2xy
+    MessageOp handle_return(int node_id, std::string_view data, std::string &out)
+    {
+        int action_id = current_action(node_id);
         if (action_id == -1)
         {
             std::cerr << "Action ID not found for client " << node_id << "!!!" << std::endl;
-            return std::make_tuple("STOP", "");
+            return MessageOp::STOP;
         }
-        task_info.erase(action_id);
-        action_ids.erase(node_id);
+        thread_local std::vector<long long> returned;
+        if (!parse_results(data, shard(node_id).binary_nodes.count(node_id) > 0, returned) || !complete_action(node_id, action_id, returned))
+            return MessageOp::STOP;
 
         int new_action_id = assign_single_task(node_id);
         if (new_action_id == -1)
         {
-            return std::make_tuple("STOP", "");
+            return no_task(out);
         }
         else
         {
-            return std::make_tuple("ASSIGN_ACTION", "1");
+            out += '1';
+            return MessageOp::ASSIGN_ACTION;
         }
     }
 
+    // a batch of (action id, result) pairs from a push node; the window is
+    // refilled by as many tasks as came back
+    MessageOp handle_returns(int node_id, std::string_view data, std::string &out)
+    {
+        bool binary = shard(node_id).binary_nodes.count(node_id) > 0;
+        thread_local std::vector<long long> returned;
+        int action_id;
+        while (next_result(data, binary, action_id, returned))
+            complete_action(node_id, action_id, returned);
+        return make_tasks(node_id, -1, out);
+    }
+
     StatData get_stat()
     {
-        int remaining_task_count = task_queue.size();
-        int client_count = node_ids.size();
+        long long remaining_task_count = queued;
         long long elapsed_time = 0;
         if (!booting_up)
         {
@@ -322,11 +1324,10 @@ public:
         return StatData(booting_up, inserting_data, done, remaining_task_count, client_count, elapsed_time);
     }
 
-    std::tuple<std::string, std::string> handle_stat(int node_id, std::string_view &data)
+    MessageOp handle_stat(int node_id, std::string_view data, std::string &out)
     {
-        StatData stat = get_stat();
-        std::string serialized_data = stat.serialize();
-        return std::make_tuple("STAT_RESP", serialized_data);
+        out += get_stat().serialize();
+        return MessageOp::STAT_RESP;
     }
 
     // websocket handlers
@@ -335,47 +1336,106 @@ public:
         std::string_view message,
         uWS::OpCode opCode)
     {
-        auto [node_id_str, op_type, action_id_str, data] = split_message(message);
-        int node_id = std::stoi(std::string(node_id_str));
-        int got_action_id = (action_id_str.size() > 0) ? std::stoi(std::string(action_id_str)) : -1;
-        if (DEBUG)
-            std::cout << "Received operation: " << op_type << " of action id " << got_action_id << " with data length of : " << data.size() << " from client " << node_id << std::endl;
+        // native workers send binary frames and get binary back; the
+        // browser worker stays on the text protocol
+        bool binary = (opCode == uWS::OpCode::BINARY);
+        int node_id, got_action_id;
+        MessageOp op;
+        std::string_view data;
+        if (binary)
+        {
+            FrameHeader header;
+            if (!split_frame(message, header, data))
+            {
+                std::cerr << "Malformed frame of " << message.size() << " bytes" << std::endl;
+                return;
+            }
+            node_id = header.node_id;
+            got_action_id = header.action_id;
+            op = (MessageOp)header.op;
+        }
+        else
+        {
+            if (!parse_message(message, node_id, op, got_action_id, data))
+            {
+                std::cerr << "Malformed message of " << message.size() << " bytes" << std::endl;
+                return;
+            }
+        }
+        NodeShard &node = shard(node_id);
+        std::lock_guard<std::mutex> lck(node.mtx);
+        if (binary)
+            node.binary_nodes.insert(node_id);
+        else
+            node.binary_nodes.erase(node_id);
+        if (TRACE_MESSAGES)
+            std::cout << "Received operation: " << op_name(op) << " of action id " << got_action_id << " with data length of : " << data.size() << " from client " << node_id << '\n';
 
-        if (got_action_id > 0 && got_action_id != find_from_map(action_ids, node_id))
+        if (got_action_id > 0 && got_action_id != current_action(node_id))
         {
             std::cerr << "Action ID mismatch for client " << node_id << "!!!" << std::endl;
             return;
         }
 
-        std::string res_op_type, res_data;
-
-        if (op_type == "ENTER")
-            std::tie(res_op_type, res_data) = handle_enter(node_id, data);
-        else if (op_type == "CLOSE")
-            std::tie(res_op_type, res_data) = handle_close(node_id, data);
-        else if (op_type == "NUDGE")
-            std::tie(res_op_type, res_data) = handle_nudge(node_id, data);
-        else if (op_type == "GET_A")
-            std::tie(res_op_type, res_data) = handle_get_a(node_id, data);
-        else if (op_type == "GET_B")
-            std::tie(res_op_type, res_data) = handle_get_b(node_id, data);
-        else if (op_type == "RETURN")
-            std::tie(res_op_type, res_data) = handle_return(node_id, data);
-        else if (op_type == "STAT")
-            std::tie(res_op_type, res_data) = handle_stat(node_id, data);
-        else
+        // the response is built in place and sent straight from the buffer
+        thread_local std::string buffer;
+        begin_message(buffer);
+        MessageOp res_op;
+        switch (op)
         {
-            res_data = "Invalid operation";
-            std::cerr << "Invalid operation " << op_type << " from client " << node_id << std::endl;
+        case MessageOp::ENTER:
+            res_op = handle_enter(node_id, data, buffer);
+            break;
+        case MessageOp::CLOSE:
+            res_op = handle_close(node_id, data, buffer);
+            break;
+        case MessageOp::NUDGE:
+            res_op = handle_nudge(node_id, data, buffer);
+            break;
+        case MessageOp::GET_A:
+            res_op = handle_get_a(node_id, data, buffer);
+            break;
+        case MessageOp::GET_B:
+            res_op = handle_get_b(node_id, data, buffer);
+            break;
+        case MessageOp::RETURN:
+            res_op = handle_return(node_id, data, buffer);
+            break;
+        case MessageOp::RETURNS:
+            res_op = handle_returns(node_id, data, buffer);
+            break;
+        case MessageOp::STAT:
+            res_op = handle_stat(node_id, data, buffer);
+            break;
+        default:
+            std::cerr << "Invalid operation " << op_name(op) << " from client " << node_id << std::endl;
             return;
         }
 
-        int action_id = find_from_map(action_ids, node_id);
+        // push nodes get the assigned task itself, which saves the
+        // ASSIGN_ACTION -> GET_A -> GET_B round trips
+        if (res_op == MessageOp::ASSIGN_ACTION && node.push_nodes.count(node_id))
+        {
+            begin_message(buffer);
+            res_op = make_tasks(node_id, node.leases[node_id].back(), buffer);
+        }
+        if (res_op == MessageOp::INVALID)
+            return; // nothing new for a node that still has tasks out
+
+        // batches carry their own action ids
+        int action_id = (res_op == MessageOp::TASKS) ? -1 : current_action(node_id);
+        uint16_t flags = 0;
+        bool operand = (res_op == MessageOp::GET_A_RESP || res_op == MessageOp::GET_B_RESP || res_op == MessageOp::TASK || res_op == MessageOp::TASKS);
+        if (binary && operand)
+            flags = operand_flags | (held_operands(node_id) ? FRAME_CACHED : 0) | (node.packed_nodes.count(node_id) ? FRAME_PACKED : 0);
+        std::string_view response = finish_message(buffer, binary, node_id, res_op, action_id, flags);
 
-        if (DEBUG)
-            std::cout << "Sending response " << res_op_type << " of action id " << action_id << " with data length of : " << res_data.size() << " to client " << node_id << std::endl;
-        std::string response = format_message(node_id, res_op_type, action_id, res_data);
-        ws->send(response, uWS::OpCode::TEXT, response.length() < 16 * 1024);
+        if (TRACE_MESSAGES)
+            std::cout << "Sending response " << op_name(res_op) << " of action id " << action_id << " with data length of : " << buffer.size() - MESSAGE_HEADROOM << " to client " << node_id << '\n';
+        if (binary)
+            ws->send(response, uWS::OpCode::BINARY, false);
+        else
+            ws->send(response, uWS::OpCode::TEXT, response.length() < 16 * 1024);
     }
 
     void close_handler(
@@ -390,7 +1450,7 @@ public:
     void get_stat_handler(uWS::HttpResponse<false> *res, uWS::HttpRequest *req)
     {
         StatData stat = get_stat();
-        float avg_throughput = (stat.elapsed_time > 0) ? ((2 * VECTOR_SIZE * VECTOR_SIZE - stat.remaining_task_count) * 1000.0 / stat.elapsed_time) : 0;
+        float avg_throughput = (stat.elapsed_time > 0) ? ((total_task_count - stat.remaining_task_count) * 1000.0 / stat.elapsed_time) : 0;
         std::string document = "<h1>Current status</h1>";
 
         document += "<p>Booting up: " + std::to_string(stat.booting_up) + "</p>";
@@ -404,10 +1464,10 @@ public:
         document += "<p>Average throughput: " + std::to_string(avg_throughput) + " tasks/sec</p>";
         document += "<br/>";
 
-        if (task_queue.size() > 0 && false)
+        if (stat.remaining_task_count > 0 && false)
         {
             document += "<p>Task status: ";
-            auto [row_idx, col_idx, sign] = unpack_action_id(task_queue.front());
+            auto [product, row_idx, col_idx, sign] = unpack_task_id(bands[band_order[0]]->tasks.back());
             document += "(" + std::to_string(row_idx) + ", " + std::to_string(col_idx) + ") ";
             // for (auto x : task_queue)
             // {
@@ -9,8 +9,13 @@
 #include <mutex>
 #include <condition_variable>
 #include <utility>
+#include <vector>
 
 #include "utils/mathlib.hpp"
+#include "utils/strassen.hpp"
+#ifndef THREAD_POOL_HPP
+#include "utils/threadPool.hpp"
+#endif
 
 void simpleMul(Matrix &A, Matrix &B, Matrix &C)
 {
@@ -30,35 +35,34 @@ void simpleMul(Matrix &A, Matrix &B, Matrix &C)
     }
 }
 
-void simpleParallelMul(Matrix &A, Matrix &B, Matrix &C, int numThreads)
+void blockedMul(Matrix &A, Matrix &B, Matrix &C)
 {
-    std::thread threads[numThreads];
-    for (int i = 0; i < numThreads; i++)
-    {
-        threads[i] = std::thread([&, i]()
-                                 {
-            for (int j = i; j < A.rows; j += numThreads)
-            {
-                for (int k = 0; k < B.cols; k++)
-                {
-                    int sum = 0;
-                    for (int l = 0; l < A.cols; l++)
-                    {
-                        sum += A.get(j, l) * B.get(l, k);
-                    }
-                    C.set(j, k, sum);
-                }
-            } });
-    }
+    C = A * B;
+}
 
-    for (int i = 0; i < numThreads; i++)
-    {
-        threads[i].join();
-    }
+void simpleParallelMul(Matrix &A, Matrix &B, Matrix &C, ThreadPool &pool)
+{
+    // C is cut into 2D tiles that the pool's workers pull and steal
+    parallelGemm<int>(pool, A.rows, B.cols, A.cols, A.rowPtr(0), A.stride, B.rowPtr(0), B.stride, C.rowPtr(0), C.stride);
+}
+
+bool sameMatrix(Matrix &X, Matrix &Y)
+{
+    if (X.rows != Y.rows || X.cols != Y.cols)
+        return false;
+    for (int i = 0; i < X.rows; i++)
+        for (int j = 0; j < X.cols; j++)
+            if (X.get(i, j) != Y.get(i, j))
+                return false;
+    return true;
 }
 
-typedef std::tuple<int, Vector, Vector> TaskInputType;
-typedef std::tuple<int, int> TaskOutputType;
+// A task is a tile of up to TASK_TILE rows by TASK_TILE columns, computed in
+// one dotBlock call. Operands are borrowed from the caller, which keeps them
+// alive until all results are in.
+const int TASK_TILE = 8;
+typedef std::tuple<int, std::vector<const Vector *>, std::vector<const Vector *>> TaskInputType;
+typedef std::tuple<int, LongMatrix> TaskOutputType;
 
 std::queue<TaskInputType> taskBuffer;
 std::mutex taskMtx;
@@ -72,14 +76,8 @@ std::atomic<bool> stopFlag(false);
 
 TaskOutputType consumeTask(TaskInputType &input)
 {
-    int sum = 0, task_id = std::get<0>(input);
-    Vector &X = std::get<1>(input);
-    Vector &Y = std::get<2>(input);
-    for (int i = 0; i < X.size; i++)
-    {
-        sum += X.get(i) * Y.get(i);
-    }
-    return std::make_tuple(task_id, sum);
+    int task_id = std::get<0>(input);
+    return std::make_tuple(task_id, dotBlock(std::get<1>(input), std::get<2>(input)));
 }
 
 void consumer(int index)
@@ -87,13 +85,13 @@ void consumer(int index)
     std::cout << "Consumer " << index << " started" << std::endl;
     while (!stopFlag)
     {
-        TaskInputType task = std::make_tuple(0, Vector(0), Vector(0));
+        TaskInputType task;
         {
             std::unique_lock<std::mutex> lck(taskMtx);
 
             taskCv.wait(lck, []
                         { return !taskBuffer.empty(); });
-            task = taskBuffer.front();
+            task = std::move(taskBuffer.front());
             taskBuffer.pop();
         }
         if (std::get<0>(task) == -1)
@@ -103,8 +101,9 @@ void consumer(int index)
         TaskOutputType result = consumeTask(task);
         {
             std::unique_lock<std::mutex> lck(resultMtx);
-            resultBuffer.push(result);
+            resultBuffer.push(std::move(result));
         }
+        resultCv.notify_one();
     }
 }
 
@@ -118,61 +117,76 @@ void simpleDistributedMul(Matrix &A, Matrix &B, Matrix &C, int numThreads)
         consumerThreads[i] = std::thread(consumer, i);
     }
 
-    Vector rows[A.rows]; // A.
-    Vector cols[B.cols]; // B.
+    std::vector<Vector> rows; // A.
+    std::vector<Vector> cols; // B.
+    rows.reserve(A.rows);
+    cols.reserve(B.cols);
 
     for (int i = 0; i < A.rows; i++)
     {
-        rows[i] = A.getRow(i);
+        rows.emplace_back(A.getRow(i));
     }
     for (int i = 0; i < B.cols; i++)
     {
-        cols[i] = B.getCol(i);
+        cols.emplace_back(B.getCol(i));
     }
-
-    for (int i = 0; i < A.rows; i++)
+    // consumers share these vectors across tiles; fill in the bound dot()
+    // would otherwise compute lazily on several threads at once
+    for (auto &v : rows)
+        v.range();
+    for (auto &v : cols)
+        v.range();
+
+    int tileRows = (A.rows + TASK_TILE - 1) / TASK_TILE;
+    int tileCols = (B.cols + TASK_TILE - 1) / TASK_TILE;
+    for (int ti = 0; ti < tileRows; ti++)
     {
-        for (int j = 0; j < B.cols; j++)
+        for (int tj = 0; tj < tileCols; tj++)
         {
-            int task_id = i * A.cols + j;
-            TaskInputType task = std::make_tuple(task_id, rows[i], cols[j]);
+            std::vector<const Vector *> tileA, tileB;
+            for (int i = ti * TASK_TILE; i < std::min(A.rows, (ti + 1) * TASK_TILE); i++)
+                tileA.push_back(&rows[i]);
+            for (int j = tj * TASK_TILE; j < std::min(B.cols, (tj + 1) * TASK_TILE); j++)
+                tileB.push_back(&cols[j]);
+            int task_id = ti * tileCols + tj;
             {
                 std::unique_lock<std::mutex> lck(taskMtx);
-                taskBuffer.push(task);
+                taskBuffer.push(std::make_tuple(task_id, std::move(tileA), std::move(tileB)));
             }
             taskCv.notify_one();
         }
     }
 
     int taskCount = 0;
-    while (taskCount < A.rows * B.cols)
+    while (taskCount < tileRows * tileCols)
     {
-        if (taskCount % 50000 == 0)
+        if (taskCount % 1000 == 0)
             std::cout << "taskCount: " << taskCount << std::endl;
 
-        TaskOutputType result = std::make_tuple(0, 0);
+        TaskOutputType result;
         {
             std::unique_lock<std::mutex> lck(resultMtx);
             resultCv.wait(lck, []
                           { return !resultBuffer.empty(); });
-            result = resultBuffer.front();
+            result = std::move(resultBuffer.front());
             resultBuffer.pop();
         }
         int task_id = std::get<0>(result);
-        int sum = std::get<1>(result);
-        int i = task_id / A.cols;
-        int j = task_id % A.cols;
-        C.set(i, j, sum);
+        LongMatrix &tile = std::get<1>(result);
+        int i0 = (task_id / tileCols) * TASK_TILE;
+        int j0 = (task_id % tileCols) * TASK_TILE;
+        for (int i = 0; i < tile.rows; i++)
+            for (int j = 0; j < tile.cols; j++)
+                C.set(i0 + i, j0 + j, tile.get(i, j));
         taskCount++;
     }
 
     stopFlag = true;
     for (int i = 0; i < numThreads; i++)
     {
-        TaskInputType task = std::make_tuple(-1, Vector(0), Vector(0));
         {
             std::unique_lock<std::mutex> lck(taskMtx);
-            taskBuffer.push(task);
+            taskBuffer.push(TaskInputType(-1, {}, {}));
         }
         taskCv.notify_one();
     }
@@ -189,6 +203,8 @@ int main()
     Matrix A = randomMatrix(VECTOR_SIZE, VECTOR_SIZE);
     Matrix B = randomMatrix(VECTOR_SIZE, VECTOR_SIZE);
 
+    ThreadPool pool(4, true);
+
     std::cout << "Start\n";
 
     //
@@ -201,15 +217,37 @@ int main()
     std::chrono::duration<double> diff = end - start;
     std::cout << "simpleMul Time: " << diff.count() << " s" << std::endl;
 
+    //
+
+    Matrix R4(VECTOR_SIZE, VECTOR_SIZE);
+    start = std::chrono::high_resolution_clock::now();
+    blockedMul(A, B, R4);
+    end = std::chrono::high_resolution_clock::now();
+
+    diff = end - start;
+    std::cout << "blockedMul (" << gemmKernel().name << ") Time: " << diff.count() << " s"
+              << (sameMatrix(R1, R4) ? "" : " MISMATCH") << std::endl;
+
+    //
+
+    start = std::chrono::high_resolution_clock::now();
+    Matrix R5 = strassenMul(A, B, VECTOR_SIZE / 4);
+    end = std::chrono::high_resolution_clock::now();
+
+    diff = end - start;
+    std::cout << "strassenMul Time: " << diff.count() << " s"
+              << (sameMatrix(R1, R5) ? "" : " MISMATCH") << std::endl;
+
     // //
 
     Matrix R2(VECTOR_SIZE, VECTOR_SIZE);
     start = std::chrono::high_resolution_clock::now();
-    simpleParallelMul(A, B, R2, 4);
+    simpleParallelMul(A, B, R2, pool);
     end = std::chrono::high_resolution_clock::now();
 
     diff = end - start;
-    std::cout << "simpleParallelMul Time: " << diff.count() << " s" << std::endl;
+    std::cout << "simpleParallelMul Time: " << diff.count() << " s"
+              << (sameMatrix(R1, R2) ? "" : " MISMATCH") << std::endl;
 
     //
 
@@ -219,7 +257,8 @@ int main()
     end = std::chrono::high_resolution_clock::now();
 
     diff = end - start;
-    std::cout << "simpleDistributedMul Time: " << diff.count() << " s" << std::endl;
+    std::cout << "simpleDistributedMul Time: " << diff.count() << " s"
+              << (sameMatrix(R1, R3) ? "" : " MISMATCH") << std::endl;
 
     return 0;
 }
\ No newline at end of file
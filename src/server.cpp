@@ -1,5 +1,8 @@
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include "App.h"
 #include "entryServer.hpp"
 
@@ -11,119 +14,225 @@
 #include "utils/mathlib.hpp"
 #endif
 
-int main()
+#ifndef MATRIX_FILE_HPP
+#include "utils/matrixFile.hpp"
+#endif
+
+int main(int argc, char **argv)
 {
     srand(time(NULL));
 
-    auto handler_ptr = new EntryServerHandler();
-    uWS::App app =
-        uWS::App()
-            .get("/stats",
-                 [&handler_ptr](auto *res, auto *req)
-                 { handler_ptr->get_stat_handler(res, req); })
-            .ws<WebSocketData>(
-                "/*",
+    // ./server [--strassen | --sparse] [--single-mask] [--tile k] [--a A.mat --b B.mat] [--out R.mat] [--no-check] [--threads n]
+    JobMode job_mode = JobMode::DIRECT;
+    MaskMode mask_mode = MaskMode::PAIRED;
+    std::string a_path, b_path, out_path;
+    bool check = true;
+    int tile = 1;
+    int threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--strassen")
+            job_mode = JobMode::STRASSEN;
+        else if (arg == "--sparse")
+            job_mode = JobMode::SPARSE;
+        else if (arg == "--single-mask")
+            mask_mode = MaskMode::SINGLE;
+        else if (arg == "--no-check")
+            check = false;
+        else if (arg == "--a" && i + 1 < argc)
+            a_path = argv[++i];
+        else if (arg == "--b" && i + 1 < argc)
+            b_path = argv[++i];
+        else if (arg == "--out" && i + 1 < argc)
+            out_path = argv[++i];
+        else if (arg == "--tile" && i + 1 < argc)
+            tile = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = std::max(1, std::atoi(argv[++i]));
+    }
+
+    // load and check the inputs before any loop thread exists, so an early
+    // return doesn't leave joinable threads behind
+    Matrix A, B;
+    if (!a_path.empty() && !b_path.empty())
+    {
+        std::cout << "Load matrix A and B\n";
+        try
+        {
+            A = loadMatrix<int>(a_path);
+            B = loadMatrix<int>(b_path);
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        if (A.cols != B.rows)
+        {
+            std::cerr << "Cannot multiply " << A.rows << "x" << A.cols << " by " << B.rows << "x" << B.cols << std::endl;
+            return 1;
+        }
+        // Masking adds up to MAX_VALUE to every operand, and a Strassen
+        // split sums up to 4 quadrants into one. The operands must stay in
+        // int, and a cell's accumulator (up to 4 tasks of `inner` products,
+        // and 4 sub-products per Strassen cell) in long long.
+        auto max_abs = [](const Matrix &M)
+        {
+            int bound = 0;
+            for (int i = 0; i < M.rows; i++)
+                bound = std::max(bound, maxAbs(M.rowPtr(i), M.cols));
+            return bound;
+        };
+        long double growth = (job_mode == JobMode::STRASSEN) ? 4 : 1;
+        long double a_max = growth * max_abs(A) + MAX_VALUE, b_max = growth * max_abs(B) + MAX_VALUE;
+        if (a_max > INT32_MAX || b_max > INT32_MAX || 4 * growth * A.cols * a_max * b_max >= 0x1p63L)
+        {
+            std::cerr << "Values of A and B are too large to mask and multiply without overflow" << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        std::cout << "Generate random matrix A and B\n";
+        // sparse jobs get inputs that are 95% zeros
+        bool sparse = (job_mode == JobMode::SPARSE);
+        A = sparse ? randomSparseMatrix(VECTOR_SIZE, VECTOR_SIZE, 0.05) : randomMatrix(VECTOR_SIZE, VECTOR_SIZE);
+        B = sparse ? randomSparseMatrix(VECTOR_SIZE, VECTOR_SIZE, 0.05) : randomMatrix(VECTOR_SIZE, VECTOR_SIZE);
+    }
+    B.cacheColumns(); // columns of B are masked and sent one at a time
+    LongMatrix R(A.rows, B.cols); // 64-bit so large jobs cannot overflow
+
+    // One event loop per thread, each with its own App listening on the same
+    // port. uSockets opens listen sockets with SO_REUSEPORT, so the kernel
+    // spreads connections over the loops. All of them share the handler,
+    // which locks per shard of nodes; more shards than threads keeps two
+    // loops from waiting on each other most of the time.
+    auto handler_ptr = new EntryServerHandler(4 * threads);
+    std::mutex apps_mtx;
+    std::vector<std::pair<uWS::Loop *, uWS::App *>> apps; // to close them from here
+    std::vector<std::thread> app_threads;
+    for (int t = 0; t < threads; t++)
+        app_threads.emplace_back(
+            [handler_ptr, &apps_mtx, &apps]()
+            {
+                uWS::App app =
+                    uWS::App()
+                        .get("/stats",
+                             [handler_ptr](auto *res, auto *req)
+                             { handler_ptr->get_stat_handler(res, req); })
+                        .ws<WebSocketData>(
+                            "/*",
+                            {
+                                /* Settings */
+                                .compression = uWS::CompressOptions(uWS::DEDICATED_COMPRESSOR_4KB | uWS::DEDICATED_DECOMPRESSOR),
+                                .maxPayloadLength = 100 * 1024 * 1024,
+                                .idleTimeout = 16,
+                                .maxBackpressure = 100 * 1024 * 1024,
+                                .closeOnBackpressureLimit = false,
+                                .resetIdleTimeoutOnSend = false,
+                                .sendPingsAutomatically = true,
+                                /* Handlers */
+                                .upgrade = nullptr,
+                                .open = [](auto * /*ws*/) {},
+                                .message = [handler_ptr](auto *ws, std::string_view message, uWS::OpCode opCode)
+                                { handler_ptr->message_handler(ws, message, opCode); },
+                                .dropped = [](auto * /*ws*/, std::string_view /*message*/, uWS::OpCode /*opCode*/)
+                                { std::cout << "Dropped message" << std::endl; },
+                                .drain = [](auto * /*ws*/) {},
+                                .ping = [](auto * /*ws*/, std::string_view)
+                                { std::cout << "Ping received." << std::endl; },
+                                .pong = [](auto * /*ws*/, std::string_view)
+                                { std::cout << "Pong received." << std::endl; },
+                                .close = [handler_ptr](auto *ws, int code, std::string_view message)
+                                { handler_ptr->close_handler(ws, code, message); },
+                            });
+
+                app.listen(ENTRY_SERVER_PORT, [](auto *listen_socket)
+                           {if (listen_socket) {std::cout << "Listening on port " << ENTRY_SERVER_PORT << std::endl;} });
                 {
-                    /* Settings */
-                    .compression = uWS::CompressOptions(uWS::DEDICATED_COMPRESSOR_4KB | uWS::DEDICATED_DECOMPRESSOR),
-                    .maxPayloadLength = 100 * 1024 * 1024,
-                    .idleTimeout = 16,
-                    .maxBackpressure = 100 * 1024 * 1024,
-                    .closeOnBackpressureLimit = false,
-                    .resetIdleTimeoutOnSend = false,
-                    .sendPingsAutomatically = true,
-                    /* Handlers */
-                    .upgrade = nullptr,
-                    .open = [](auto * /*ws*/) {},
-                    .message = [&handler_ptr](auto *ws, std::string_view message, uWS::OpCode opCode)
-                    { handler_ptr->message_handler(ws, message, opCode); },
-                    .dropped = [](auto * /*ws*/, std::string_view /*message*/, uWS::OpCode /*opCode*/)
-                    { std::cout << "Dropped message" << std::endl; },
-                    .drain = [](auto * /*ws*/) {},
-                    .ping = [](auto * /*ws*/, std::string_view)
-                    { std::cout << "Ping received." << std::endl; },
-                    .pong = [](auto * /*ws*/, std::string_view)
-                    { std::cout << "Pong received." << std::endl; },
-                    .close = [&handler_ptr](auto *ws, int code, std::string_view message)
-                    { handler_ptr->close_handler(ws, code, message); },
-                });
-
-    app.listen(ENTRY_SERVER_PORT, [](auto *listen_socket)
-               {if (listen_socket) {std::cout << "Listening on port " << ENTRY_SERVER_PORT << std::endl;} });
-
-    std::cout << "Generate random matrix A and B\n";
-    Matrix A = randomMatrix(VECTOR_SIZE, VECTOR_SIZE);
-    Matrix B = randomMatrix(VECTOR_SIZE, VECTOR_SIZE);
-    Matrix R(VECTOR_SIZE, VECTOR_SIZE);
-    for (int i = 0; i < VECTOR_SIZE; i++)
-        for (int j = 0; j < VECTOR_SIZE; j++)
-            R.set(i, j, 0);
+                    std::lock_guard<std::mutex> lck(apps_mtx);
+                    apps.emplace_back(uWS::Loop::get(), &app);
+                }
+                app.run();
+            });
 
     auto start = std::chrono::high_resolution_clock::now();
     auto end = std::chrono::high_resolution_clock::now();
 
     int BOOTUP_SECONDS = 5;
     std::thread bootup_thread = std::thread(
-        [&start, handler_ptr, BOOTUP_SECONDS, &A, &B, &R]()
+        [&start, handler_ptr, BOOTUP_SECONDS, job_mode, mask_mode, tile, &A, &B, &R]()
         {
             std::cout << "Booting up..." << std::endl;
             std::this_thread::sleep_for(std::chrono::seconds(BOOTUP_SECONDS));
             std::cout << "Booted up. Starting initialization." << std::endl;
 
-            handler_ptr->set_input_data(A, B, R);
+            handler_ptr->set_input_data(A, B, R, job_mode, mask_mode, tile);
 
             std::cout << "Start!\n";
-            handler_ptr->booting_up = false;
             handler_ptr->start = std::chrono::high_resolution_clock::now();
             start = std::chrono::high_resolution_clock::now();
+            handler_ptr->booting_up = false; // publishes the job to the event loops
         });
 
     std::thread cleanup_thread = std::thread(
-        [&start, &end, handler_ptr, &app, &A, &B, &R]()
+        [&start, &end, handler_ptr, &A, &B, &R, check, out_path]()
         {
             while (handler_ptr->booting_up)
             {
                 std::this_thread::sleep_for(std::chrono::seconds(1));
             }
+            // done is set by whichever event loop adds the last result, once
+            // R is final; until then, look for leases that are late
             while (!handler_ptr->done)
             {
-                std::this_thread::sleep_for(std::chrono::seconds(1));
-                while (handler_ptr->task_queue.size() == 0 && handler_ptr->action_ids.size() > 0)
-                {
-                    auto it = handler_ptr->action_ids.begin();
-                    if ((*it).second <= 0)
-                        handler_ptr->action_ids.erase(it);
-                }
-                if (handler_ptr->task_queue.size() == 0 && handler_ptr->action_ids.size() == 0)
-                {
-                    std::cout << "All tasks done. Cleaning up..." << std::endl;
-                    handler_ptr->done = true;
-                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(250));
+                handler_ptr->check_leases();
             }
+            std::cout << "All tasks done. Cleaning up..." << std::endl;
             end = std::chrono::high_resolution_clock::now();
 
-            // check answers
-            bool was_wrong = false;
-            for (int i = 0; i < VECTOR_SIZE; i++)
-                for (int j = 0; j < VECTOR_SIZE; j++)
-                {
-                    long long now = A.getRow(i).dot(B.getCol(j));
-                    if (R.get(i, j) / 2 != now)
+            std::cout << "Time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+            if (!out_path.empty())
+            {
+                saveMatrix(R, out_path);
+                std::cout << "Wrote R to " << out_path << std::endl;
+            }
+
+            // check answers against a local product, computed on all cores
+            if (check)
+            {
+                bool was_wrong = false;
+                LongMatrix expected(A.rows, B.cols);
+                parallelGemm<long long>(defaultPool(), A.rows, B.cols, A.cols, A.rowPtr(0), A.stride, B.rowPtr(0), B.stride, expected.rowPtr(0), expected.stride);
+                for (int i = 0; i < A.rows; i++)
+                    for (int j = 0; j < B.cols; j++)
                     {
-                        std::cout << "Error at " << i << " " << j << " : " << R.get(i, j) / 2 << " != " << now << std::endl;
-                        was_wrong = true;
+                        long long now = expected.get(i, j);
+                        if (R.get(i, j) != now)
+                        {
+                            std::cout << "Error at " << i << " " << j << " : " << R.get(i, j) << " != " << now << std::endl;
+                            was_wrong = true;
+                        }
                     }
-                }
-            std::cout << "Done. " << (was_wrong ? "Error" : "Correct!!!") << std::endl;
-            std::cout << "Time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms" << std::endl;
+                std::cout << "Done. " << (was_wrong ? "Error" : "Correct!!!") << std::endl;
+            }
         });
 
-    app.run();
     bootup_thread.join();
     cleanup_thread.join();
 
     std::this_thread::sleep_for(std::chrono::minutes(5));
-    app.close();
+    {
+        // an App may only be touched from its own loop's thread
+        std::lock_guard<std::mutex> lck(apps_mtx);
+        for (auto [loop, app] : apps)
+            loop->defer([app]()
+                        { app->close(); });
+    }
+    for (auto &t : app_threads)
+        t.join();
 
     return 0;
 }
@@ -0,0 +1,110 @@
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+#endif
+
+// Bump allocator for short-lived operand buffers. allocate() hands out
+// aligned slices of large blocks; reset() rewinds without freeing, so once a
+// handler has seen its largest task, later tasks allocate nothing from the
+// heap. Memory is only returned to the system when the arena is destroyed.
+//
+// Anything allocated from an arena must be dead (or moved out of) before the
+// next reset().
+class Arena
+{
+private:
+    struct Block
+    {
+        char *data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t block_size;
+    size_t current = 0; // index of the block being bumped
+    size_t used = 0;    // bytes used in blocks[current]
+
+    void addBlock(size_t min_size)
+    {
+        size_t size = std::max(block_size, (min_size + 63) / 64 * 64);
+        blocks.push_back({static_cast<char *>(std::aligned_alloc(64, size)), size});
+    }
+
+public:
+    Arena(size_t block_size = 1 << 20)
+    {
+        this->block_size = block_size;
+    }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        for (auto &block : blocks)
+            std::free(block.data);
+    }
+
+    void *allocate(size_t bytes, size_t align = 64)
+    {
+        if (bytes == 0)
+            return nullptr;
+        while (current < blocks.size())
+        {
+            size_t offset = (used + align - 1) / align * align;
+            if (offset + bytes <= blocks[current].size)
+            {
+                used = offset + bytes;
+                return blocks[current].data + offset;
+            }
+            current++;
+            used = 0;
+        }
+        addBlock(bytes);
+        current = blocks.size() - 1;
+        used = bytes;
+        return blocks[current].data;
+    }
+
+    template <typename T>
+    T *allocate(size_t count)
+    {
+        return static_cast<T *>(allocate(count * sizeof(T), std::max<size_t>(64, alignof(T))));
+    }
+
+    // position of the bump pointer, for stack-like scratch use
+    struct Marker
+    {
+        size_t block;
+        size_t used;
+    };
+
+    Marker mark() const
+    {
+        return {current, used};
+    }
+
+    void rewind(Marker marker)
+    {
+        current = marker.block;
+        used = marker.used;
+    }
+
+    void reset()
+    {
+        current = 0;
+        used = 0;
+    }
+
+    size_t capacity() const
+    {
+        size_t total = 0;
+        for (auto &block : blocks)
+            total += block.size;
+        return total;
+    }
+};
@@ -2,6 +2,12 @@
 #include <array>
 #include <utility>
 #include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <bit>
+#include <charconv>
+#include <algorithm>
+#include <vector>
 
 #ifndef DATA_MODEL_HPP
 #define DATA_MODEL_HPP
@@ -11,6 +17,7 @@ const int ENTRY_SERVER_PORT = 9000;
 const int CLIENT_COUNT = 16;
 const std::string SERVER_HOSTNAME = "10.29.230.222";
 const bool DEBUG = true;
+const bool TRACE_MESSAGES = false; // log every message the entry server handles
 
 std::tuple<std::string_view, std::string_view, std::string_view, std::string_view> split_message(const std::string_view &s)
 {
@@ -30,6 +37,585 @@ std::string format_message(int node_id, const std::string &op_type, int action_i
     return std::move(message);
 }
 
+bool parse_int(std::string_view s, int &value)
+{
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    return ec == std::errc() && end == s.data() + s.size();
+}
+
+// decimal digits of value onto the end of s
+void append_int(std::string &s, long long value)
+{
+    char digits[24];
+    auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), value);
+    s.append(digits, end);
+}
+
+// Length-prefixed sections written in place: reserve_length() leaves room
+// for a uint32 and returns where the section starts, patch_length() fills
+// in how many bytes were appended since.
+size_t reserve_length(std::string &s)
+{
+    s.append(sizeof(uint32_t), '\0');
+    return s.size();
+}
+
+void patch_length(std::string &s, size_t start)
+{
+    uint32_t length = s.size() - start;
+    std::memcpy(s.data() + start - sizeof(uint32_t), &length, sizeof(length));
+}
+
+// Binary framing, used by native workers instead of the ";;" text format
+// (which the browser worker keeps using). A frame is a FrameHeader followed
+// by `length` payload bytes; everything is little-endian.
+static_assert(std::endian::native == std::endian::little, "the binary protocol is sent in host byte order");
+
+const uint8_t WIRE_VERSION = 1;
+
+enum class MessageOp : uint8_t
+{
+    INVALID = 0,
+    ENTER,
+    ENTER_RESP,
+    CLOSE,
+    NUDGE,
+    NUDGE_RESP,
+    ASSIGN_ACTION,
+    GET_A,
+    GET_A_RESP,
+    GET_B,
+    GET_B_RESP,
+    RETURN,
+    STAT,
+    STAT_RESP,
+    STOP,
+    TASK,
+    TASKS,
+    RETURNS,
+};
+
+constexpr std::array<const char *, 18> MESSAGE_OP_NAMES = {
+    "", "ENTER", "ENTER_RESP", "CLOSE", "NUDGE", "NUDGE_RESP", "ASSIGN_ACTION", "GET_A",
+    "GET_A_RESP", "GET_B", "GET_B_RESP", "RETURN", "STAT", "STAT_RESP", "STOP", "TASK",
+    "TASKS", "RETURNS"};
+
+const int MAX_CREDITS = 64;
+const int MIN_CACHE = 2; // one task's two operands must fit at once
+const int MAX_CACHE = 1 << 16;
+
+// ENTER payload: space separated options, e.g. "PUSH 8 CACHE 1024".
+//   PUSH [credits]  tasks are pushed as TASK messages (both operands at
+//                   once) instead of fetched with ASSIGN_ACTION/GET_A/GET_B;
+//                   with credits, up to that many are outstanding at a time
+//                   (fewer while the server finds the node slow), sent as
+//                   TASKS batches and answered with RETURNS batches
+//   CACHE entries   the node keeps an LRU cache of that many operands, and
+//                   ones it already holds are sent as their id only
+//   PACK            operands in binary frames are bit-packed (FRAME_PACKED)
+struct EnterOptions
+{
+    bool push = false;
+    int credits = 1;
+    int cache = 0;
+    bool pack = false;
+
+    std::string serialize() const
+    {
+        std::string s;
+        if (push)
+            s += credits > 1 ? "PUSH " + std::to_string(credits) + " " : "PUSH ";
+        if (cache > 0)
+            s += "CACHE " + std::to_string(cache) + " ";
+        if (pack)
+            s += "PACK ";
+        if (!s.empty())
+            s.pop_back();
+        return s;
+    }
+
+    static int clampCache(int entries)
+    {
+        return entries < MIN_CACHE ? 0 : std::min(entries, MAX_CACHE);
+    }
+
+    static EnterOptions parse(std::string_view s)
+    {
+        EnterOptions options;
+        auto next = [&s](std::string_view &token)
+        {
+            while (!s.empty() && s.front() == ' ')
+                s.remove_prefix(1);
+            token = s.substr(0, s.find(' '));
+            s.remove_prefix(token.size());
+            return !token.empty();
+        };
+        auto number = [](std::string_view token, int &value)
+        {
+            return std::from_chars(token.data(), token.data() + token.size(), value).ec == std::errc();
+        };
+        std::string_view token;
+        bool have = next(token);
+        while (have)
+        {
+            int value = 0;
+            if (token == "PUSH")
+            {
+                options.push = true;
+                have = next(token);
+                if (have && number(token, value))
+                {
+                    options.credits = std::clamp(value, 1, MAX_CREDITS);
+                    have = next(token);
+                }
+            }
+            else if (token == "CACHE")
+            {
+                have = next(token);
+                if (have && number(token, value))
+                {
+                    options.cache = clampCache(value);
+                    have = next(token);
+                }
+            }
+            else if (token == "PACK")
+            {
+                options.pack = true;
+                have = next(token);
+            }
+            else
+                have = next(token);
+        }
+        return options;
+    }
+};
+
+// payload flags for GET_A_RESP / GET_B_RESP / TASK
+const uint16_t FRAME_INT16 = 1;   // values are int16 instead of int32
+const uint16_t FRAME_SPARSE = 2;  // int32 size, int32 indices, then values
+const uint16_t FRAME_CACHED = 4;  // each operand is prefixed with its id
+const uint16_t FRAME_BLOCK = 8;   // operands come in blocks (tiled jobs)
+const uint16_t FRAME_PACKED = 16; // values bit-packed, sparse indices as varint gaps
+
+struct FrameHeader
+{
+    uint8_t version;
+    uint8_t op; // MessageOp
+    uint16_t flags;
+    int32_t node_id;
+    int32_t action_id;
+    uint32_t length;
+};
+static_assert(sizeof(FrameHeader) == 16, "frame header must stay packed");
+
+std::string_view op_name(MessageOp op)
+{
+    size_t i = (size_t)op;
+    return i < MESSAGE_OP_NAMES.size() ? MESSAGE_OP_NAMES[i] : "";
+}
+
+// Text messages name their op. The names hash to distinct slots of
+// MESSAGE_OP_TABLE (checked when it is built, at compile time), so a
+// lookup is one hash and one compare.
+const size_t MESSAGE_OP_TABLE_SIZE = 32;
+
+constexpr size_t op_hash(std::string_view name)
+{
+    uint32_t x = 0;
+    for (char c : name)
+        x = x * 9 + (unsigned char)c;
+    return (x ^ (x >> 16)) % MESSAGE_OP_TABLE_SIZE;
+}
+
+constexpr std::array<uint8_t, MESSAGE_OP_TABLE_SIZE> make_op_table()
+{
+    std::array<uint8_t, MESSAGE_OP_TABLE_SIZE> table{};
+    for (size_t i = 1; i < MESSAGE_OP_NAMES.size(); i++)
+    {
+        if (table[op_hash(MESSAGE_OP_NAMES[i])] != 0)
+            throw "op names collide in MESSAGE_OP_TABLE; change op_hash";
+        table[op_hash(MESSAGE_OP_NAMES[i])] = i;
+    }
+    return table;
+}
+
+constexpr std::array<uint8_t, MESSAGE_OP_TABLE_SIZE> MESSAGE_OP_TABLE = make_op_table();
+
+MessageOp op_from_name(std::string_view name)
+{
+    uint8_t i = MESSAGE_OP_TABLE[op_hash(name)];
+    return (i != 0 && name == MESSAGE_OP_NAMES[i]) ? (MessageOp)i : MessageOp::INVALID;
+}
+
+// text messages start with the node id, so never with WIRE_VERSION
+bool is_frame(std::string_view s)
+{
+    return s.size() >= sizeof(FrameHeader) && (uint8_t)s[0] == WIRE_VERSION;
+}
+
+std::string format_frame(int node_id, MessageOp op, int action_id, std::string_view payload, uint16_t flags = 0)
+{
+    FrameHeader header{WIRE_VERSION, (uint8_t)op, flags, node_id, action_id, (uint32_t)payload.size()};
+    std::string frame(sizeof(header) + payload.size(), '\0');
+    std::memcpy(frame.data(), &header, sizeof(header));
+    std::memcpy(frame.data() + sizeof(header), payload.data(), payload.size());
+    return frame;
+}
+
+// node_id;;OP;;action_id;;data, parsed without copying; an empty action id
+// reads as -1. False if the ids are not numbers.
+bool parse_message(std::string_view s, int &node_id, MessageOp &op, int &action_id, std::string_view &data)
+{
+    auto [node_id_str, op_str, action_id_str, rest] = split_message(s);
+    action_id = -1;
+    if (!parse_int(node_id_str, node_id) || (!action_id_str.empty() && !parse_int(action_id_str, action_id)))
+        return false;
+    op = op_from_name(op_str);
+    data = rest;
+    return true;
+}
+
+// Responses are built in place in one reusable buffer: begin_message()
+// leaves room for the largest header, the payload is appended after it,
+// and finish_message() writes the header just in front of the payload and
+// returns the whole message as a view into the buffer.
+const size_t MESSAGE_HEADROOM = 48;
+
+void begin_message(std::string &buffer)
+{
+    buffer.assign(MESSAGE_HEADROOM, '\0');
+}
+
+std::string_view finish_message(std::string &buffer, bool binary, int node_id, MessageOp op, int action_id, uint16_t flags = 0)
+{
+    char *payload = buffer.data() + MESSAGE_HEADROOM;
+    size_t length = buffer.size() - MESSAGE_HEADROOM;
+    char header[MESSAGE_HEADROOM];
+    size_t size;
+    if (binary)
+    {
+        FrameHeader frame{WIRE_VERSION, (uint8_t)op, flags, node_id, action_id, (uint32_t)length};
+        std::memcpy(header, &frame, sizeof(frame));
+        size = sizeof(frame);
+    }
+    else
+    {
+        std::string_view name = op_name(op);
+        char *p = std::to_chars(header, header + 12, node_id).ptr;
+        *p++ = ';', *p++ = ';';
+        p = std::copy(name.begin(), name.end(), p);
+        *p++ = ';', *p++ = ';';
+        p = std::to_chars(p, p + 12, action_id).ptr;
+        *p++ = ';', *p++ = ';';
+        size = p - header;
+    }
+    std::memcpy(payload - size, header, size);
+    return std::string_view(payload - size, size + length);
+}
+
+// false if the frame is truncated or from another protocol version
+bool split_frame(std::string_view s, FrameHeader &header, std::string_view &payload)
+{
+    if (!is_frame(s))
+        return false;
+    std::memcpy(&header, s.data(), sizeof(header));
+    if (s.size() - sizeof(header) < header.length)
+        return false;
+    payload = s.substr(sizeof(header), header.length);
+    return true;
+}
+
+template <typename T>
+void append_scalar(std::string &s, T value)
+{
+    s.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+T decode_scalar(std::string_view s)
+{
+    T value = 0;
+    std::memcpy(&value, s.data(), std::min(s.size(), sizeof(T)));
+    return value;
+}
+
+// TASK payload: both operands, as GET_A_RESP then GET_B_RESP would carry
+// them. Binary frames prefix the first with its uint32 length; text
+// separates the two with '|'. Written in place: begin_task_payload(), the
+// first operand, end_first_operand(), the second operand.
+size_t begin_task_payload(std::string &s, bool binary)
+{
+    return binary ? reserve_length(s) : 0;
+}
+
+void end_first_operand(std::string &s, size_t start, bool binary)
+{
+    if (binary)
+        patch_length(s, start);
+    else
+        s += '|';
+}
+
+bool split_task_payload(std::string_view s, bool binary, std::string_view &first, std::string_view &second)
+{
+    size_t split;
+    if (binary)
+    {
+        if (s.size() < sizeof(uint32_t))
+            return false;
+        split = decode_scalar<uint32_t>(s);
+        s.remove_prefix(sizeof(uint32_t));
+        if (split > s.size())
+            return false;
+        first = s.substr(0, split);
+        second = s.substr(split);
+        return true;
+    }
+    split = s.find('|');
+    if (split == std::string_view::npos)
+        return false;
+    first = s.substr(0, split);
+    second = s.substr(split + 1);
+    return true;
+}
+
+// TASKS payload: a run of (action id, TASK payload) entries. Binary is
+// int32 id, uint32 length, payload; text is "id#payload\n". Each entry is
+// begin_task(), its TASK payload, end_task(). An entry with action id
+// WINDOW_ENTRY carries the node's current window (decimal) instead.
+const int WINDOW_ENTRY = 0;
+
+size_t begin_task(std::string &batch, int action_id, bool binary)
+{
+    if (binary)
+    {
+        append_scalar<int32_t>(batch, action_id);
+        return reserve_length(batch);
+    }
+    append_int(batch, action_id);
+    batch += '#';
+    return 0;
+}
+
+void end_task(std::string &batch, size_t start, bool binary)
+{
+    if (binary)
+        patch_length(batch, start);
+    else
+        batch += '\n';
+}
+
+// takes the first entry off `batch`; false once it is empty or malformed
+bool next_task(std::string_view &batch, bool binary, int &action_id, std::string_view &task)
+{
+    if (binary)
+    {
+        if (batch.size() < sizeof(int32_t) + sizeof(uint32_t))
+            return false;
+        action_id = decode_scalar<int32_t>(batch);
+        uint32_t length = decode_scalar<uint32_t>(batch.substr(sizeof(int32_t)));
+        batch.remove_prefix(sizeof(int32_t) + sizeof(uint32_t));
+        if (length > batch.size())
+            return false;
+        task = batch.substr(0, length);
+        batch.remove_prefix(length);
+        return true;
+    }
+    size_t mark = batch.find('#'), end = batch.find('\n');
+    if (mark == std::string_view::npos || end == std::string_view::npos || end < mark)
+        return false;
+    if (!parse_int(batch.substr(0, mark), action_id))
+        return false;
+    task = batch.substr(mark + 1, end - mark - 1);
+    batch.remove_prefix(end + 1);
+    return true;
+}
+
+// Results of one task, row-major over its tile (a single value unless the
+// job is tiled). RETURN carries them as int64s, or as decimals each
+// followed by a space (or a comma, inside RETURNS).
+std::string format_results(const std::vector<long long> &results, bool binary)
+{
+    if (binary)
+        return std::string(reinterpret_cast<const char *>(results.data()), results.size() * sizeof(int64_t));
+    std::string s;
+    for (long long r : results)
+    {
+        s += std::to_string(r);
+        s += ' ';
+    }
+    return s;
+}
+
+bool parse_results(std::string_view s, bool binary, std::vector<long long> &results)
+{
+    results.clear();
+    if (binary)
+    {
+        if (s.size() % sizeof(int64_t) != 0)
+            return false;
+        results.resize(s.size() / sizeof(int64_t));
+        std::memcpy(results.data(), s.data(), s.size());
+        return true;
+    }
+    const char *p = s.data(), *end = s.data() + s.size();
+    while (p < end)
+    {
+        if (*p == ' ' || *p == ',')
+        {
+            p++;
+            continue;
+        }
+        long long r;
+        auto [next, ec] = std::from_chars(p, end, r);
+        if (ec != std::errc())
+            return false;
+        results.push_back(r);
+        p = next;
+    }
+    return true;
+}
+
+// RETURNS payload: a run of (action id, results) entries. Binary is int32
+// id, uint32 count and count int64s; text is "id:r,r,r ".
+void append_result(std::string &batch, int action_id, const std::vector<long long> &results, bool binary)
+{
+    if (binary)
+    {
+        append_scalar<int32_t>(batch, action_id);
+        append_scalar<uint32_t>(batch, results.size());
+        batch.append(reinterpret_cast<const char *>(results.data()), results.size() * sizeof(int64_t));
+        return;
+    }
+    append_int(batch, action_id);
+    batch += ':';
+    for (size_t k = 0; k < results.size(); k++)
+    {
+        if (k > 0)
+            batch += ',';
+        append_int(batch, results[k]);
+    }
+    batch += ' ';
+}
+
+bool next_result(std::string_view &batch, bool binary, int &action_id, std::vector<long long> &results)
+{
+    if (binary)
+    {
+        if (batch.size() < sizeof(int32_t) + sizeof(uint32_t))
+            return false;
+        action_id = decode_scalar<int32_t>(batch);
+        size_t bytes = (size_t)decode_scalar<uint32_t>(batch.substr(sizeof(int32_t))) * sizeof(int64_t);
+        batch.remove_prefix(sizeof(int32_t) + sizeof(uint32_t));
+        if (bytes > batch.size())
+            return false;
+        parse_results(batch.substr(0, bytes), true, results);
+        batch.remove_prefix(bytes);
+        return true;
+    }
+    size_t mark = batch.find(':'), end = batch.find(' ');
+    if (mark == std::string_view::npos || end == std::string_view::npos || end < mark)
+        return false;
+    std::string_view values = batch.substr(mark + 1, end - mark - 1);
+    bool ok = parse_int(batch.substr(0, mark), action_id);
+    batch.remove_prefix(end + 1);
+    return ok && parse_results(values, false, results);
+}
+
+// Operands of a tiled job travel in blocks: binary is a uint32 count, then
+// a uint32 length and the bytes of each operand (with FRAME_BLOCK set);
+// text joins them with '/'. Written in place: begin_operand_block(), then
+// begin_block_operand(), the operand and end_block_operand() for each.
+void begin_operand_block(std::string &s, uint32_t count, bool binary)
+{
+    if (binary)
+        append_scalar<uint32_t>(s, count);
+}
+
+size_t begin_block_operand(std::string &s, uint32_t k, bool binary)
+{
+    if (binary)
+        return reserve_length(s);
+    if (k > 0)
+        s += '/';
+    return 0;
+}
+
+void end_block_operand(std::string &s, size_t start, bool binary)
+{
+    if (binary)
+        patch_length(s, start);
+}
+
+bool split_operand_block(std::string_view s, bool binary, std::vector<std::string_view> &operands)
+{
+    operands.clear();
+    if (!binary)
+    {
+        size_t start = 0, slash;
+        while ((slash = s.find('/', start)) != std::string_view::npos)
+        {
+            operands.push_back(s.substr(start, slash - start));
+            start = slash + 1;
+        }
+        operands.push_back(s.substr(start));
+        return true;
+    }
+    if (s.size() < sizeof(uint32_t))
+        return false;
+    uint32_t count = decode_scalar<uint32_t>(s);
+    s.remove_prefix(sizeof(uint32_t));
+    for (uint32_t k = 0; k < count; k++)
+    {
+        if (s.size() < sizeof(uint32_t))
+            return false;
+        uint32_t length = decode_scalar<uint32_t>(s);
+        s.remove_prefix(sizeof(uint32_t));
+        if (length > s.size())
+            return false;
+        operands.push_back(s.substr(0, length));
+        s.remove_prefix(length);
+    }
+    return true;
+}
+
+// Operand for a node with a cache: its id, then the operand itself unless
+// the node already holds it. Binary is an int32 id (with FRAME_CACHED set);
+// text is "=id" or "=id,operand". This writes the id part; the operand, if
+// `follows`, goes right after it.
+void append_cached_id(std::string &s, int id, bool follows, bool binary)
+{
+    if (binary)
+    {
+        append_scalar<int32_t>(s, id);
+        return;
+    }
+    s += '=';
+    append_int(s, id);
+    if (follows)
+        s += ',';
+}
+
+bool split_cached_operand(std::string_view s, bool binary, int &id, std::string_view &operand)
+{
+    if (binary)
+    {
+        if (s.size() < sizeof(int32_t))
+            return false;
+        id = decode_scalar<int32_t>(s);
+        operand = s.substr(sizeof(int32_t));
+        return true;
+    }
+    if (s.empty() || s[0] != '=')
+        return false;
+    size_t comma = s.find(',');
+    auto [end, ec] = std::from_chars(s.data() + 1, s.data() + std::min(comma, s.size()), id);
+    if (ec != std::errc())
+        return false;
+    operand = (comma == std::string_view::npos) ? std::string_view() : s.substr(comma + 1);
+    return true;
+}
+
 class ISerializable
 {
 public:
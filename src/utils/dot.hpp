@@ -0,0 +1,286 @@
+#include <cstdint>
+#include <climits>
+#include <algorithm>
+#include <immintrin.h>
+
+#ifndef DOT_HPP
+#define DOT_HPP
+#endif
+
+#ifndef GEMM_HPP
+#include "gemm.hpp"
+#endif
+
+// Dot products of int32 vectors, always accumulated exactly into 64 bits.
+//
+// Wide kernels multiply 32x32->64 (pmuldq) on even/odd lanes. Narrow kernels
+// are used when both operands are known to fit in int16: they pack to 16 bits,
+// multiply-add pairs into int32 (pmaddwd / vpdpwssd) and widen the int32
+// accumulators into 64 bits often enough that they can never overflow.
+
+const int DOT_NARROW_LIMIT = 32767; // 2 * 32767^2 still fits in an int32 lane
+const int DOT_MIN_SIMD = 32;
+
+inline int maxAbs(const int32_t *x, int n)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int32_t s = x[i] >> 31;
+        result = std::max(result, (uint32_t)((x[i] ^ s) - s));
+    }
+    return (int)std::min<uint32_t>(result, INT_MAX);
+}
+
+inline long long dotScalar(const int32_t *a, const int32_t *b, int n)
+{
+    long long result = 0;
+    for (int i = 0; i < n; i++)
+        result += (long long)a[i] * b[i];
+    return result;
+}
+
+// Number of pair-sums an int32 lane can absorb before it has to be widened.
+inline int dotNarrowChunk(int bound_a, int bound_b)
+{
+    long long pair = 2LL * std::max(bound_a, 1) * std::max(bound_b, 1);
+    return (int)std::max<long long>(1, INT32_MAX / pair);
+}
+
+__attribute__((target("sse4.1"))) inline long long dotSse4(const int32_t *a, const int32_t *b, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        acc = _mm_add_epi64(acc, _mm_mul_epi32(x, y));
+        acc = _mm_add_epi64(acc, _mm_mul_epi32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32)));
+    }
+    long long result = _mm_extract_epi64(acc, 0) + _mm_extract_epi64(acc, 1);
+    return result + dotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline long long dotAvx2(const int32_t *a, const int32_t *b, int n)
+{
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        acc0 = _mm256_add_epi64(acc0, _mm256_mul_epi32(x, y));
+        acc1 = _mm256_add_epi64(acc1, _mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32)));
+    }
+    alignas(32) long long lanes[4];
+    _mm256_store_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+    long long result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return result + dotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f"))) inline long long dotAvx512(const int32_t *a, const int32_t *b, int n)
+{
+    __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512i x = _mm512_loadu_si512((const void *)(a + i));
+        __m512i y = _mm512_loadu_si512((const void *)(b + i));
+        acc0 = _mm512_add_epi64(acc0, _mm512_mul_epi32(x, y));
+        acc1 = _mm512_add_epi64(acc1, _mm512_mul_epi32(_mm512_srli_epi64(x, 32), _mm512_srli_epi64(y, 32)));
+    }
+    long long result = _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+    return result + dotScalar(a + i, b + i, n - i);
+}
+
+// packs_epi32 interleaves 128-bit lanes, but a and b are permuted the same
+// way so the dot product is unaffected.
+__attribute__((target("avx2"))) inline long long dotAvx2Narrow(const int32_t *a, const int32_t *b, int n, int chunk)
+{
+    __m256i wide = _mm256_setzero_si256();
+    int i = 0;
+    while (i + 16 <= n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        for (int c = 0; c < chunk && i + 16 <= n; c++, i += 16)
+        {
+            __m256i x = _mm256_packs_epi32(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                           _mm256_loadu_si256((const __m256i *)(a + i + 8)));
+            __m256i y = _mm256_packs_epi32(_mm256_loadu_si256((const __m256i *)(b + i)),
+                                           _mm256_loadu_si256((const __m256i *)(b + i + 8)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+        }
+        wide = _mm256_add_epi64(wide, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(acc)));
+        wide = _mm256_add_epi64(wide, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(acc, 1)));
+    }
+    alignas(32) long long lanes[4];
+    _mm256_store_si256((__m256i *)lanes, wide);
+    long long result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return result + dotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline long long dotAvx512Narrow(const int32_t *a, const int32_t *b, int n, int chunk)
+{
+    __m512i wide = _mm512_setzero_si512();
+    int i = 0;
+    while (i + 32 <= n)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        for (int c = 0; c < chunk && i + 32 <= n; c++, i += 32)
+        {
+            __m512i x = _mm512_packs_epi32(_mm512_loadu_si512((const void *)(a + i)),
+                                           _mm512_loadu_si512((const void *)(a + i + 16)));
+            __m512i y = _mm512_packs_epi32(_mm512_loadu_si512((const void *)(b + i)),
+                                           _mm512_loadu_si512((const void *)(b + i + 16)));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(x, y));
+        }
+        wide = _mm512_add_epi64(wide, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc)));
+        wide = _mm512_add_epi64(wide, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc, 1)));
+    }
+    long long result = _mm512_reduce_add_epi64(wide);
+    return result + dotScalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni"))) inline long long dotVnni(const int32_t *a, const int32_t *b, int n, int chunk)
+{
+    __m512i wide = _mm512_setzero_si512();
+    int i = 0;
+    while (i + 32 <= n)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        for (int c = 0; c < chunk && i + 32 <= n; c++, i += 32)
+        {
+            __m512i x = _mm512_packs_epi32(_mm512_loadu_si512((const void *)(a + i)),
+                                           _mm512_loadu_si512((const void *)(a + i + 16)));
+            __m512i y = _mm512_packs_epi32(_mm512_loadu_si512((const void *)(b + i)),
+                                           _mm512_loadu_si512((const void *)(b + i + 16)));
+            acc = _mm512_dpwssd_epi32(acc, x, y);
+        }
+        wide = _mm512_add_epi64(wide, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc)));
+        wide = _mm512_add_epi64(wide, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc, 1)));
+    }
+    long long result = _mm512_reduce_add_epi64(wide);
+    return result + dotScalar(a + i, b + i, n - i);
+}
+
+// Exact 64-bit dot product of two contiguous int32 vectors.
+inline long long dotWide(const int32_t *a, const int32_t *b, int n)
+{
+    if (n < DOT_MIN_SIMD)
+        return dotScalar(a, b, n);
+    const CpuFeatures &cpu = cpuFeatures();
+    if (cpu.avx512f)
+        return dotAvx512(a, b, n);
+    if (cpu.avx2)
+        return dotAvx2(a, b, n);
+    if (__builtin_cpu_supports("sse4.1"))
+        return dotSse4(a, b, n);
+    return dotScalar(a, b, n);
+}
+
+// Same as dotWide, but takes |element| bounds for a and b (-1 if unknown)
+// and switches to the 16-bit kernels whenever both bounds allow it.
+inline long long dotProduct(const int32_t *a, const int32_t *b, int n, int bound_a = -1, int bound_b = -1)
+{
+    if (n < DOT_MIN_SIMD)
+        return dotScalar(a, b, n);
+    if (bound_a < 0)
+        bound_a = maxAbs(a, n);
+    if (bound_b < 0)
+        bound_b = maxAbs(b, n);
+    if (bound_a > DOT_NARROW_LIMIT || bound_b > DOT_NARROW_LIMIT)
+        return dotWide(a, b, n);
+
+    int chunk = dotNarrowChunk(bound_a, bound_b);
+    const CpuFeatures &cpu = cpuFeatures();
+    if (cpu.avx512vnni && cpu.avx512bw)
+        return dotVnni(a, b, n, chunk);
+    if (cpu.avx512bw)
+        return dotAvx512Narrow(a, b, n, chunk);
+    if (cpu.avx2)
+        return dotAvx2Narrow(a, b, n, chunk);
+    return dotWide(a, b, n);
+}
+
+// 4 x 4 block of dot products in one pass over the data: each 16-bit packed
+// load of a row is reused against four columns, and all 16 sums stay in
+// registers. Partial sums are reduced into `sums` every `chunk` steps.
+__attribute__((target("avx512f,avx512bw"))) inline void dotBlock4x4Narrow(const int32_t *const *rows, const int32_t *const *cols, int n, int chunk, long long sums[4][4])
+{
+    int i = 0;
+    while (i + 32 <= n)
+    {
+        __m512i acc[4][4];
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 4; c++)
+                acc[r][c] = _mm512_setzero_si512();
+        for (int step = 0; step < chunk && i + 32 <= n; step++, i += 32)
+        {
+            __m512i x[4];
+            for (int r = 0; r < 4; r++)
+                x[r] = _mm512_packs_epi32(_mm512_loadu_si512((const void *)(rows[r] + i)),
+                                          _mm512_loadu_si512((const void *)(rows[r] + i + 16)));
+            for (int c = 0; c < 4; c++)
+            {
+                __m512i y = _mm512_packs_epi32(_mm512_loadu_si512((const void *)(cols[c] + i)),
+                                               _mm512_loadu_si512((const void *)(cols[c] + i + 16)));
+                for (int r = 0; r < 4; r++)
+                    acc[r][c] = _mm512_add_epi32(acc[r][c], _mm512_madd_epi16(x[r], y));
+            }
+        }
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 4; c++)
+                sums[r][c] += _mm512_reduce_add_epi64(_mm512_add_epi64(
+                    _mm512_cvtepi32_epi64(_mm512_castsi512_si256(acc[r][c])),
+                    _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(acc[r][c], 1))));
+    }
+    for (; i < n; i++)
+        for (int r = 0; r < 4; r++)
+            for (int c = 0; c < 4; c++)
+                sums[r][c] += (long long)rows[r][i] * cols[c][i];
+}
+
+// out[r * ldo + c] = rows[r] . cols[c] for nr rows and nc columns of length
+// n: a whole product tile per call. Uses the 4 x 4 register-blocked kernel
+// when the operands fit in 16 bits, and the single dot kernels for the rest.
+// Bounds are max |element| over all rows / all columns, -1 if unknown.
+inline void dotBlock(int nr, const int32_t *const *rows, int nc, const int32_t *const *cols, int n, long long *out, int ldo, int bound_rows = -1, int bound_cols = -1)
+{
+    if (bound_rows < 0)
+    {
+        bound_rows = 0;
+        for (int r = 0; r < nr; r++)
+            bound_rows = std::max(bound_rows, maxAbs(rows[r], n));
+    }
+    if (bound_cols < 0)
+    {
+        bound_cols = 0;
+        for (int c = 0; c < nc; c++)
+            bound_cols = std::max(bound_cols, maxAbs(cols[c], n));
+    }
+
+    int r0 = 0, c0 = 0;
+    if (bound_rows <= DOT_NARROW_LIMIT && bound_cols <= DOT_NARROW_LIMIT && cpuFeatures().avx512bw && n >= DOT_MIN_SIMD)
+    {
+        int chunk = dotNarrowChunk(bound_rows, bound_cols);
+        r0 = nr / 4 * 4;
+        c0 = nc / 4 * 4;
+        for (int r = 0; r < r0; r += 4)
+        {
+            for (int c = 0; c < c0; c += 4)
+            {
+                long long sums[4][4] = {};
+                dotBlock4x4Narrow(rows + r, cols + c, n, chunk, sums);
+                for (int x = 0; x < 4; x++)
+                    for (int y = 0; y < 4; y++)
+                        out[(size_t)(r + x) * ldo + c + y] = sums[x][y];
+            }
+        }
+    }
+
+    // edges (or everything, without the block kernel)
+    for (int r = 0; r < nr; r++)
+        for (int c = (r < r0) ? c0 : 0; c < nc; c++)
+            out[(size_t)r * ldo + c] = dotProduct(rows[r], cols[c], n, bound_rows, bound_cols);
+}
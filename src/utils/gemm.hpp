@@ -0,0 +1,373 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <type_traits>
+#include <immintrin.h>
+
+#ifndef GEMM_HPP
+#define GEMM_HPP
+#endif
+
+// Blocked int32 GEMM: C = A * B (or C += A * B).
+//
+// Layout follows the usual Goto/BLIS scheme: B is packed into KC x NC panels
+// of NR-wide slivers, A into MC x KC panels of MR-tall slivers, and a
+// register-blocked micro-kernel computes one MR x NR tile of C at a time.
+// The micro-kernel accumulates in int32, which is exact modulo 2^32; for a
+// 64-bit output the K panel is shortened so partial sums cannot overflow
+// before they are widened into C.
+
+struct CpuFeatures
+{
+    bool avx2;
+    bool avx512f;
+    bool avx512bw;
+    bool avx512vnni;
+
+    CpuFeatures()
+    {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2");
+        avx512f = __builtin_cpu_supports("avx512f");
+        avx512bw = __builtin_cpu_supports("avx512bw");
+        avx512vnni = __builtin_cpu_supports("avx512vnni");
+    }
+};
+
+inline const CpuFeatures &cpuFeatures()
+{
+    static const CpuFeatures features;
+    return features;
+}
+
+const int GEMM_MC = 96;
+const int GEMM_KC = 256;
+const int GEMM_NC = 2048;
+const int GEMM_MAX_MR = 6;
+const int GEMM_MAX_NR = 32;
+
+typedef void (*GemmKernel)(int kc, const int32_t *pa, const int32_t *pb, int32_t *tile);
+
+struct GemmKernelInfo
+{
+    GemmKernel kernel;
+    int mr;
+    int nr;
+    const char *name;
+};
+
+// tile is MR x NR, row-major with a row stride of NR
+inline void gemmKernelScalar(int kc, const int32_t *pa, const int32_t *pb, int32_t *tile)
+{
+    const int MR = 4, NR = 4;
+    uint32_t acc[MR][NR] = {};
+    for (int k = 0; k < kc; k++)
+    {
+        for (int r = 0; r < MR; r++)
+        {
+            uint32_t a = (uint32_t)pa[k * MR + r];
+            for (int c = 0; c < NR; c++)
+                acc[r][c] += a * (uint32_t)pb[k * NR + c];
+        }
+    }
+    for (int r = 0; r < MR; r++)
+        for (int c = 0; c < NR; c++)
+            tile[r * NR + c] = (int32_t)acc[r][c];
+}
+
+__attribute__((target("avx2"))) inline void gemmKernelAvx2(int kc, const int32_t *pa, const int32_t *pb, int32_t *tile)
+{
+    // 6 x 16 tile: 12 ymm accumulators, 2 for B, 1 for the broadcast of A
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256();
+    __m256i c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256();
+    __m256i c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    __m256i c40 = _mm256_setzero_si256(), c41 = _mm256_setzero_si256();
+    __m256i c50 = _mm256_setzero_si256(), c51 = _mm256_setzero_si256();
+    for (int k = 0; k < kc; k++)
+    {
+        __m256i b0 = _mm256_load_si256((const __m256i *)(pb + k * 16));
+        __m256i b1 = _mm256_load_si256((const __m256i *)(pb + k * 16 + 8));
+        const int32_t *a = pa + k * 6;
+        __m256i av;
+        av = _mm256_set1_epi32(a[0]);
+        c00 = _mm256_add_epi32(c00, _mm256_mullo_epi32(av, b0));
+        c01 = _mm256_add_epi32(c01, _mm256_mullo_epi32(av, b1));
+        av = _mm256_set1_epi32(a[1]);
+        c10 = _mm256_add_epi32(c10, _mm256_mullo_epi32(av, b0));
+        c11 = _mm256_add_epi32(c11, _mm256_mullo_epi32(av, b1));
+        av = _mm256_set1_epi32(a[2]);
+        c20 = _mm256_add_epi32(c20, _mm256_mullo_epi32(av, b0));
+        c21 = _mm256_add_epi32(c21, _mm256_mullo_epi32(av, b1));
+        av = _mm256_set1_epi32(a[3]);
+        c30 = _mm256_add_epi32(c30, _mm256_mullo_epi32(av, b0));
+        c31 = _mm256_add_epi32(c31, _mm256_mullo_epi32(av, b1));
+        av = _mm256_set1_epi32(a[4]);
+        c40 = _mm256_add_epi32(c40, _mm256_mullo_epi32(av, b0));
+        c41 = _mm256_add_epi32(c41, _mm256_mullo_epi32(av, b1));
+        av = _mm256_set1_epi32(a[5]);
+        c50 = _mm256_add_epi32(c50, _mm256_mullo_epi32(av, b0));
+        c51 = _mm256_add_epi32(c51, _mm256_mullo_epi32(av, b1));
+    }
+    _mm256_store_si256((__m256i *)(tile + 0 * 16), c00);
+    _mm256_store_si256((__m256i *)(tile + 0 * 16 + 8), c01);
+    _mm256_store_si256((__m256i *)(tile + 1 * 16), c10);
+    _mm256_store_si256((__m256i *)(tile + 1 * 16 + 8), c11);
+    _mm256_store_si256((__m256i *)(tile + 2 * 16), c20);
+    _mm256_store_si256((__m256i *)(tile + 2 * 16 + 8), c21);
+    _mm256_store_si256((__m256i *)(tile + 3 * 16), c30);
+    _mm256_store_si256((__m256i *)(tile + 3 * 16 + 8), c31);
+    _mm256_store_si256((__m256i *)(tile + 4 * 16), c40);
+    _mm256_store_si256((__m256i *)(tile + 4 * 16 + 8), c41);
+    _mm256_store_si256((__m256i *)(tile + 5 * 16), c50);
+    _mm256_store_si256((__m256i *)(tile + 5 * 16 + 8), c51);
+}
+
+__attribute__((target("avx512f"))) inline void gemmKernelAvx512(int kc, const int32_t *pa, const int32_t *pb, int32_t *tile)
+{
+    // 6 x 32 tile: 12 zmm accumulators
+    __m512i acc[6][2];
+    for (int r = 0; r < 6; r++)
+        acc[r][0] = acc[r][1] = _mm512_setzero_si512();
+    for (int k = 0; k < kc; k++)
+    {
+        __m512i b0 = _mm512_load_si512((const void *)(pb + k * 32));
+        __m512i b1 = _mm512_load_si512((const void *)(pb + k * 32 + 16));
+        const int32_t *a = pa + k * 6;
+        for (int r = 0; r < 6; r++)
+        {
+            __m512i av = _mm512_set1_epi32(a[r]);
+            acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_mullo_epi32(av, b0));
+            acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_mullo_epi32(av, b1));
+        }
+    }
+    for (int r = 0; r < 6; r++)
+    {
+        _mm512_store_si512((void *)(tile + r * 32), acc[r][0]);
+        _mm512_store_si512((void *)(tile + r * 32 + 16), acc[r][1]);
+    }
+}
+
+inline const GemmKernelInfo &gemmKernel()
+{
+    static const GemmKernelInfo info = []()
+    {
+        const CpuFeatures &cpu = cpuFeatures();
+        if (cpu.avx512f)
+            return GemmKernelInfo{gemmKernelAvx512, 6, 32, "avx512"};
+        if (cpu.avx2)
+            return GemmKernelInfo{gemmKernelAvx2, 6, 16, "avx2"};
+        return GemmKernelInfo{gemmKernelScalar, 4, 4, "scalar"};
+    }();
+    return info;
+}
+
+// Per-thread packing buffers, grown on demand and reused across calls.
+struct GemmWorkspace
+{
+    int32_t *pack_a = nullptr;
+    int32_t *pack_b = nullptr;
+    size_t cap_a = 0;
+    size_t cap_b = 0;
+
+    static int32_t *grow(int32_t *buf, size_t &cap, size_t need)
+    {
+        if (need <= cap)
+            return buf;
+        std::free(buf);
+        cap = (need + 15) / 16 * 16;
+        return static_cast<int32_t *>(std::aligned_alloc(64, cap * sizeof(int32_t)));
+    }
+
+    int32_t *a(size_t need) { return pack_a = grow(pack_a, cap_a, need); }
+    int32_t *b(size_t need) { return pack_b = grow(pack_b, cap_b, need); }
+
+    ~GemmWorkspace()
+    {
+        std::free(pack_a);
+        std::free(pack_b);
+    }
+};
+
+inline GemmWorkspace &gemmWorkspace()
+{
+    thread_local GemmWorkspace ws;
+    return ws;
+}
+
+// Pack an mc x kc block of A into MR-tall slivers, zero-padding the last one.
+inline void gemmPackA(int mc, int kc, const int32_t *A, int lda, int mr, int32_t *dst)
+{
+    for (int i = 0; i < mc; i += mr)
+    {
+        int rows = std::min(mr, mc - i);
+        for (int k = 0; k < kc; k++)
+        {
+            for (int r = 0; r < rows; r++)
+                dst[r] = A[(size_t)(i + r) * lda + k];
+            for (int r = rows; r < mr; r++)
+                dst[r] = 0;
+            dst += mr;
+        }
+    }
+}
+
+// Pack a kc x nc block of B into NR-wide slivers, zero-padding the last one.
+inline void gemmPackB(int kc, int nc, const int32_t *B, int ldb, int nr, int32_t *dst)
+{
+    for (int j = 0; j < nc; j += nr)
+    {
+        int cols = std::min(nr, nc - j);
+        for (int k = 0; k < kc; k++)
+        {
+            const int32_t *src = B + (size_t)k * ldb + j;
+            std::memcpy(dst, src, cols * sizeof(int32_t));
+            for (int c = cols; c < nr; c++)
+                dst[c] = 0;
+            dst += nr;
+        }
+    }
+}
+
+inline long long gemmMaxAbs(int rows, int cols, const int32_t *X, int ldx)
+{
+    long long result = 0;
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++)
+            result = std::max(result, std::llabs((long long)X[(size_t)i * ldx + j]));
+    return result;
+}
+
+// Largest K panel whose int32 partial sums are guaranteed not to overflow.
+// Returns 0 when even a single product may not fit.
+inline int gemmSafeKc(long long max_a, long long max_b)
+{
+    long long max_prod = max_a * max_b;
+    if (max_prod == 0)
+        return GEMM_KC;
+    return (int)std::min<long long>(GEMM_KC, INT32_MAX / max_prod);
+}
+
+template <typename OutT>
+void gemmScalarWide(int M, int N, int K, const int32_t *A, int lda, const int32_t *B, int ldb, OutT *C, int ldc, bool accumulate)
+{
+    for (int i = 0; i < M; i++)
+    {
+        OutT *c = C + (size_t)i * ldc;
+        if (!accumulate)
+            for (int j = 0; j < N; j++)
+                c[j] = 0;
+        for (int k = 0; k < K; k++)
+        {
+            long long a = A[(size_t)i * lda + k];
+            const int32_t *b = B + (size_t)k * ldb;
+            for (int j = 0; j < N; j++)
+                c[j] += (OutT)(a * b[j]);
+        }
+    }
+}
+
+// C (M x N) = A (M x K) * B (K x N), or C += A * B when accumulate is set.
+// All matrices are row-major with the given leading dimensions. OutT is int
+// (result modulo 2^32, like the old loop) or long long (exact).
+template <typename OutT>
+void gemm(int M, int N, int K, const int32_t *A, int lda, const int32_t *B, int ldb, OutT *C, int ldc, bool accumulate = false)
+{
+    if (M <= 0 || N <= 0)
+        return;
+
+    int kc_max = GEMM_KC;
+    if (sizeof(OutT) > sizeof(int32_t))
+    {
+        kc_max = gemmSafeKc(gemmMaxAbs(M, K, A, lda), gemmMaxAbs(K, N, B, ldb));
+        if (kc_max == 0)
+        {
+            gemmScalarWide(M, N, K, A, lda, B, ldb, C, ldc, accumulate);
+            return;
+        }
+    }
+
+    if (!accumulate)
+        for (int i = 0; i < M; i++)
+            std::fill(C + (size_t)i * ldc, C + (size_t)i * ldc + N, (OutT)0);
+    if (K <= 0)
+        return;
+
+    const GemmKernelInfo &kern = gemmKernel();
+    const int mr = kern.mr, nr = kern.nr;
+    const int mc_max = GEMM_MC / mr * mr;
+    const int nc_max = GEMM_NC / nr * nr;
+
+    GemmWorkspace &ws = gemmWorkspace();
+    int32_t *pack_b = ws.b((size_t)kc_max * nc_max);
+    int32_t *pack_a = ws.a((size_t)mc_max * kc_max);
+    alignas(64) int32_t tile[GEMM_MAX_MR * GEMM_MAX_NR];
+
+    for (int jc = 0; jc < N; jc += nc_max)
+    {
+        int nc = std::min(nc_max, N - jc);
+        for (int pc = 0; pc < K; pc += kc_max)
+        {
+            int kc = std::min(kc_max, K - pc);
+            gemmPackB(kc, nc, B + (size_t)pc * ldb + jc, ldb, nr, pack_b);
+            for (int ic = 0; ic < M; ic += mc_max)
+            {
+                int mc = std::min(mc_max, M - ic);
+                gemmPackA(mc, kc, A + (size_t)ic * lda + pc, lda, mr, pack_a);
+                for (int jr = 0; jr < nc; jr += nr)
+                {
+                    int cols = std::min(nr, nc - jr);
+                    const int32_t *pb = pack_b + (size_t)jr * kc;
+                    for (int ir = 0; ir < mc; ir += mr)
+                    {
+                        int rows = std::min(mr, mc - ir);
+                        kern.kernel(kc, pack_a + (size_t)ir * kc, pb, tile);
+                        for (int r = 0; r < rows; r++)
+                        {
+                            OutT *c = C + (size_t)(ic + ir + r) * ldc + jc + jr;
+                            for (int x = 0; x < cols; x++)
+                                c[x] += (OutT)tile[r * nr + x];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Element types without a packed kernel (int64, the uint64 ring, float and
+// double) go through a cache-blocked i-k-j loop the compiler can vectorize.
+// Signed 64-bit sums are done in unsigned arithmetic so overflow wraps
+// instead of being undefined.
+template <typename T>
+void gemmGeneric(int M, int N, int K, const T *A, int lda, const T *B, int ldb, T *C, int ldc, bool accumulate = false)
+{
+    typedef typename std::conditional<std::is_same<T, long long>::value, unsigned long long, T>::type W;
+    const int NB = GEMM_NC / 4;
+
+    if (!accumulate)
+        for (int i = 0; i < M; i++)
+            std::fill(C + (size_t)i * ldc, C + (size_t)i * ldc + N, (T)0);
+
+    for (int jc = 0; jc < N; jc += NB)
+    {
+        int nc = std::min(NB, N - jc);
+        for (int pc = 0; pc < K; pc += GEMM_KC)
+        {
+            int kc = std::min(GEMM_KC, K - pc);
+            for (int i = 0; i < M; i++)
+            {
+                W *c = reinterpret_cast<W *>(C + (size_t)i * ldc + jc);
+                for (int k = pc; k < pc + kc; k++)
+                {
+                    W a = (W)A[(size_t)i * lda + k];
+                    const T *b = B + (size_t)k * ldb + jc;
+                    for (int j = 0; j < nc; j++)
+                        c[j] += a * (W)b[j];
+                }
+            }
+        }
+    }
+}
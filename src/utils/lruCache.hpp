@@ -0,0 +1,85 @@
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+#ifndef LRU_CACHE_HPP
+#define LRU_CACHE_HPP
+#endif
+
+// Fixed-capacity map that evicts the least recently used entry. Entries do
+// not move once inserted, so pointers to values stay valid until that entry
+// is evicted or the cache is cleared.
+//
+// The entry server keeps one LruCache per worker with no values, only to
+// mirror what the worker's own cache holds: both sides see the same
+// sequence of keys, so both make the same evictions.
+template <typename K, typename V>
+class LruCache
+{
+private:
+    typedef std::list<std::pair<K, V>> List;
+
+    List entries; // most recently used first
+    std::unordered_map<K, typename List::iterator> index;
+    size_t capacity;
+
+public:
+    LruCache(size_t capacity = 0)
+    {
+        this->capacity = capacity;
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    size_t getCapacity() const
+    {
+        return capacity;
+    }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+    }
+
+    // the value for key, now most recently used; nullptr if absent
+    V *find(const K &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+            return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    // a fresh value for key (replacing any old one), evicting if full
+    V &insert(const K &key)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        if (capacity > 0 && entries.size() >= capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.emplace_front(key, V());
+        index[key] = entries.begin();
+        return entries.front().second;
+    }
+
+    // find() or insert(); true if key was already there
+    bool touch(const K &key)
+    {
+        if (find(key) != nullptr)
+            return true;
+        insert(key);
+        return false;
+    }
+};
@@ -1,58 +1,308 @@
-#include <random>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <climits>
+#include <type_traits>
+#include <vector>
+#include <memory>
 
 #ifndef MATHLIB_HPP
 #define MATHLIB_HPP
 #endif
 
-class Vector
+#ifndef GEMM_HPP
+#include "gemm.hpp"
+#endif
+#ifndef DOT_HPP
+#include "dot.hpp"
+#endif
+#ifndef ARENA_HPP
+#include "arena.hpp"
+#endif
+#ifndef RNG_HPP
+#include "rng.hpp"
+#endif
+#ifndef THREAD_POOL_HPP
+#include "threadPool.hpp"
+#endif
+
+// Element types a Vector/Matrix can hold. acc_type is what dot products
+// accumulate into; tag prefixes the binary serialization.
+template <typename T>
+struct ElementTraits;
+
+template <>
+struct ElementTraits<int>
+{
+    typedef long long acc_type;
+    static constexpr const char *tag = "VECTOR_INT:";
+};
+
+template <>
+struct ElementTraits<long long>
+{
+    typedef long long acc_type; // wraps modulo 2^64 on overflow
+    static constexpr const char *tag = "VECTOR_LONG:";
+};
+
+// the wrapping ring Z/2^64, for additive masking
+template <>
+struct ElementTraits<uint64_t>
+{
+    typedef uint64_t acc_type;
+    static constexpr const char *tag = "VECTOR_RING:";
+};
+
+template <>
+struct ElementTraits<float>
+{
+    typedef double acc_type;
+    static constexpr const char *tag = "VECTOR_FLOAT:";
+};
+
+template <>
+struct ElementTraits<double>
+{
+    typedef double acc_type;
+    static constexpr const char *tag = "VECTOR_DOUBLE:";
+};
+
+// Generic dot loop for element types without a dedicated kernel. Four
+// independent accumulators so the compiler can vectorize it; signed 64-bit
+// sums wrap through unsigned arithmetic.
+template <typename T>
+typename ElementTraits<T>::acc_type dotGeneric(const T *a, const T *b, int n)
+{
+    typedef typename ElementTraits<T>::acc_type Acc;
+    typedef typename std::conditional<std::is_same<Acc, long long>::value, unsigned long long, Acc>::type W;
+    W acc[4] = {};
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        for (int l = 0; l < 4; l++)
+            acc[l] += (W)a[i + l] * (W)b[i + l];
+    for (; i < n; i++)
+        acc[0] += (W)a[i] * (W)b[i];
+    return (Acc)(acc[0] + acc[1] + acc[2] + acc[3]);
+}
+
+template <typename T>
+inline typename ElementTraits<T>::acc_type dotContiguous(const T *a, const T *b, int n)
+{
+    if constexpr (std::is_same<T, int>::value)
+        return dotWide(a, b, n);
+    else
+        return dotGeneric(a, b, n);
+}
+
+// every matrix buffer (and every row inside it) starts on a cache line
+const int MATRIX_ALIGNMENT = 64;
+
+template <typename T>
+inline int alignedStride(int cols)
+{
+    const int per_line = MATRIX_ALIGNMENT / sizeof(T);
+    return (cols + per_line - 1) / per_line * per_line;
+}
+
+template <typename T>
+inline T *allocAligned(size_t count)
+{
+    size_t bytes = (count * sizeof(T) + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+    if (bytes == 0)
+        return nullptr;
+    return static_cast<T *>(std::aligned_alloc(MATRIX_ALIGNMENT, bytes));
+}
+
+template <typename T>
+class BasicVector;
+
+// Non-owning, possibly strided window over a row or column of a Matrix.
+// Only valid while the matrix it was taken from is alive.
+template <typename T>
+class BasicVectorView
 {
 public:
-    int *data;
+    typedef typename ElementTraits<T>::acc_type acc_type;
+
+    const T *data;
     int size;
-    Vector(int size = 0)
+    int stride;
+
+    BasicVectorView(const T *data = nullptr, int size = 0, int stride = 1)
     {
+        this->data = data;
         this->size = size;
-        this->data = new int[size];
+        this->stride = stride;
+    }
+
+    inline T get(int i) const
+    {
+        return data[(size_t)i * stride];
     }
 
-    ~Vector()
+    inline bool contiguous() const
     {
-        // delete[] data;
+        return stride == 1;
     }
 
-    inline int get(int i)
+    acc_type dot(const BasicVectorView &other) const
+    {
+        if (contiguous() && other.contiguous())
+            return dotContiguous(data, other.data, size);
+        acc_type result = 0;
+        for (int i = 0; i < size; i++)
+            result += (acc_type)get(i) * other.get(i);
+        return result;
+    }
+
+    BasicVector<T> operator+(const BasicVectorView &other) const;
+    BasicVector<T> operator-(const BasicVectorView &other) const;
+
+    // same as + and -, with the result allocated from an arena
+    BasicVector<T> plus(const BasicVectorView &other, Arena &arena) const;
+    BasicVector<T> minus(const BasicVectorView &other, Arena &arena) const;
+};
+
+template <typename T>
+class BasicVector
+{
+public:
+    typedef typename ElementTraits<T>::acc_type acc_type;
+
+    T *data;
+    int size;
+    // upper bound on |data[i]| (int only), or -1 if unknown; lets dot() pick
+    // the 16-bit kernels. Cleared by set(), filled in lazily by range(),
+    // which writes it: call range() before sharing a vector between threads.
+    mutable int bound = -1;
+    // set when data lives in an arena; the arena then owns the memory
+    Arena *arena = nullptr;
+
+    BasicVector(int size = 0)
+    {
+        this->size = size;
+        this->data = allocAligned<T>(size);
+    }
+
+    BasicVector(int size, Arena &arena)
+    {
+        this->size = size;
+        this->data = arena.allocate<T>(size);
+        this->arena = &arena;
+    }
+
+    // materialize a view into an owned vector
+    explicit BasicVector(const BasicVectorView<T> &view)
+    {
+        this->size = view.size;
+        this->data = allocAligned<T>(size);
+        for (int i = 0; i < size; i++)
+            data[i] = view.get(i);
+    }
+
+    // copies must be asked for with clone()
+    BasicVector(const BasicVector &) = delete;
+    BasicVector &operator=(const BasicVector &) = delete;
+
+    BasicVector(BasicVector &&other) noexcept
+    {
+        this->size = std::exchange(other.size, 0);
+        this->data = std::exchange(other.data, nullptr);
+        this->bound = std::exchange(other.bound, -1);
+        this->arena = std::exchange(other.arena, nullptr);
+    }
+
+    BasicVector &operator=(BasicVector &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            this->size = std::exchange(other.size, 0);
+            this->data = std::exchange(other.data, nullptr);
+            this->bound = std::exchange(other.bound, -1);
+            this->arena = std::exchange(other.arena, nullptr);
+        }
+        return *this;
+    }
+
+    ~BasicVector()
+    {
+        release();
+    }
+
+    void release()
+    {
+        if (arena == nullptr)
+            std::free(data);
+        data = nullptr;
+        arena = nullptr;
+        size = 0;
+        bound = -1;
+    }
+
+    BasicVector clone() const
+    {
+        BasicVector result(size);
+        std::copy(data, data + size, result.data);
+        result.bound = bound;
+        return result;
+    }
+
+    inline T get(int i) const
     {
         return data[i];
     }
 
-    inline void set(int i, int value)
+    inline void set(int i, T value)
     {
         data[i] = value;
+        bound = -1;
     }
 
-    Vector operator+(Vector &other)
+    int range() const
     {
-        Vector result(size);
+        if (bound < 0)
+            bound = maxAbs(data, size);
+        return bound;
+    }
+
+    static int sumBound(int x, int y)
+    {
+        if (x < 0 || y < 0)
+            return -1;
+        return (int)std::min<long long>((long long)x + y, INT_MAX);
+    }
+
+    BasicVector operator+(const BasicVector &other) const
+    {
+        BasicVector result(size);
         for (int i = 0; i < size; i++)
         {
             result.set(i, get(i) + other.get(i));
         }
+        result.bound = sumBound(bound, other.bound);
         return result;
     }
 
-    Vector operator-(Vector &other)
+    BasicVector operator-(const BasicVector &other) const
     {
-        Vector result(size);
+        BasicVector result(size);
         for (int i = 0; i < size; i++)
         {
             result.set(i, get(i) - other.get(i));
         }
+        result.bound = sumBound(bound, other.bound);
         return result;
     }
 
-    Vector operator*(int scalar)
+    BasicVector operator*(T scalar) const
     {
-        Vector result(size);
+        BasicVector result(size);
         for (int i = 0; i < size; i++)
         {
             result.set(i, get(i) * scalar);
@@ -60,108 +310,265 @@ public:
         return result;
     }
 
-    long long dot(const Vector &other)
+    acc_type dot(const BasicVector &other) const
     {
-        long long result = 0;
-        for (int i = 0; i < size; i++)
-        {
-            result += data[i] * other.data[i];
-        }
-        return result;
+        if constexpr (std::is_same<T, int>::value)
+            return dotProduct(data, other.data, size, range(), other.range());
+        else
+            return dotGeneric(data, other.data, size);
+    }
+
+    acc_type dot(const BasicVectorView<T> &other) const
+    {
+        return view().dot(other);
+    }
+
+    BasicVectorView<T> view() const
+    {
+        return BasicVectorView<T>(data, size, 1);
     }
 
     std::string serialize()
     {
-        std::string result = "VECTOR_INT:";
-        result += std::string(reinterpret_cast<const char *>(data), sizeof(int) * size);
+        std::string result = ElementTraits<T>::tag;
+        result += std::string(reinterpret_cast<const char *>(data), sizeof(T) * size);
         return result;
     }
 
-    static Vector deserialize(const std::string &s)
+    static BasicVector deserialize(const std::string &s)
     {
-        std::string data = s.substr(11);
-        Vector result(data.size() / sizeof(int));
+        std::string data = s.substr(std::strlen(ElementTraits<T>::tag));
+        BasicVector result(data.size() / sizeof(T));
         for (int i = 0; i < result.size; i++)
         {
-            result.set(i, *reinterpret_cast<const int *>(data.data() + i * sizeof(int)));
+            result.set(i, *reinterpret_cast<const T *>(data.data() + i * sizeof(T)));
         }
         return result;
     }
 };
 
-class Matrix
+template <typename T>
+BasicVector<T> BasicVectorView<T>::operator+(const BasicVectorView<T> &other) const
+{
+    BasicVector<T> result(size);
+    for (int i = 0; i < size; i++)
+    {
+        result.set(i, get(i) + other.get(i));
+    }
+    return result;
+}
+
+template <typename T>
+BasicVector<T> BasicVectorView<T>::operator-(const BasicVectorView<T> &other) const
+{
+    BasicVector<T> result(size);
+    for (int i = 0; i < size; i++)
+    {
+        result.set(i, get(i) - other.get(i));
+    }
+    return result;
+}
+
+template <typename T>
+BasicVector<T> BasicVectorView<T>::plus(const BasicVectorView<T> &other, Arena &arena) const
+{
+    BasicVector<T> result(size, arena);
+    for (int i = 0; i < size; i++)
+    {
+        result.set(i, get(i) + other.get(i));
+    }
+    return result;
+}
+
+template <typename T>
+BasicVector<T> BasicVectorView<T>::minus(const BasicVectorView<T> &other, Arena &arena) const
+{
+    BasicVector<T> result(size, arena);
+    for (int i = 0; i < size; i++)
+    {
+        result.set(i, get(i) - other.get(i));
+    }
+    return result;
+}
+
+// Row-major matrix in a single 64-byte aligned buffer. Rows are padded to
+// `stride` elements so every row starts on a cache line. Optionally keeps a
+// column-major copy (see cacheColumns) so getCol() is contiguous too.
+// The buffer can also live elsewhere (e.g. a mapped file), kept alive by
+// `backing` instead of being freed.
+template <typename T>
+class BasicMatrix
 {
 private:
-    int **data;
+    T *data;
+    T *col_data; // column-major copy, nullptr until cacheColumns()
+    int col_stride;
+    std::shared_ptr<void> backing; // owner of data when it is not ours
+
+    void release()
+    {
+        if (backing == nullptr)
+            std::free(data);
+        std::free(col_data);
+        backing.reset();
+        data = nullptr;
+        col_data = nullptr;
+    }
 
 public:
     int rows;
     int cols;
+    int stride;
 
-    Matrix()
+    BasicMatrix()
     {
         this->rows = 0;
         this->cols = 0;
+        this->stride = 0;
+        this->col_stride = 0;
         this->data = nullptr;
+        this->col_data = nullptr;
     }
-    Matrix(int rows, int cols)
+    BasicMatrix(int rows, int cols)
     {
         this->rows = rows;
         this->cols = cols;
-        this->data = new int *[rows];
-        for (int i = 0; i < rows; i++)
-        {
-            this->data[i] = new int[cols];
-        }
+        this->stride = alignedStride<T>(cols);
+        this->col_stride = 0;
+        this->data = allocAligned<T>((size_t)rows * stride);
+        this->col_data = nullptr;
+        if (data != nullptr)
+            std::memset(data, 0, (size_t)rows * stride * sizeof(T));
+    }
+    // wraps rows x cols elements at `data` (row stride `stride`, 64-byte
+    // aligned) without copying; `backing` keeps that memory alive
+    BasicMatrix(int rows, int cols, int stride, T *data, std::shared_ptr<void> backing)
+    {
+        this->rows = rows;
+        this->cols = cols;
+        this->stride = stride;
+        this->col_stride = 0;
+        this->data = data;
+        this->col_data = nullptr;
+        this->backing = std::move(backing);
     }
 
-    ~Matrix()
+    BasicMatrix(const BasicMatrix &) = delete;
+    BasicMatrix &operator=(const BasicMatrix &) = delete;
+
+    BasicMatrix(BasicMatrix &&other) noexcept
     {
-        for (int i = 0; i < rows; i++)
+        this->rows = other.rows;
+        this->cols = other.cols;
+        this->stride = other.stride;
+        this->col_stride = other.col_stride;
+        this->data = std::exchange(other.data, nullptr);
+        this->col_data = std::exchange(other.col_data, nullptr);
+        this->backing = std::move(other.backing);
+        other.rows = other.cols = other.stride = other.col_stride = 0;
+    }
+
+    BasicMatrix &operator=(BasicMatrix &&other) noexcept
+    {
+        if (this != &other)
         {
-            delete[] data[i];
+            release();
+            this->rows = other.rows;
+            this->cols = other.cols;
+            this->stride = other.stride;
+            this->col_stride = other.col_stride;
+            this->data = std::exchange(other.data, nullptr);
+            this->col_data = std::exchange(other.col_data, nullptr);
+            this->backing = std::move(other.backing);
+            other.rows = other.cols = other.stride = other.col_stride = 0;
         }
-        delete[] data;
+        return *this;
     }
 
-    int get(int i, int j)
+    ~BasicMatrix()
     {
-        return data[i][j];
+        release();
     }
 
-    void set(int i, int j, int value)
+    inline T get(int i, int j) const
     {
-        data[i][j] = value;
+        return data[(size_t)i * stride + j];
     }
 
-    void add(int i, int j, int value)
+    inline void set(int i, int j, T value)
     {
-        data[i][j] += value;
+        data[(size_t)i * stride + j] = value;
+        if (col_data != nullptr)
+            col_data[(size_t)j * col_stride + i] = value;
     }
 
-    Vector getRow(int i)
+    inline void add(int i, int j, T value)
     {
-        Vector result = Vector(cols);
-        for (int j = 0; j < cols; j++)
-        {
-            result.set(j, get(i, j));
-        }
-        return result;
+        data[(size_t)i * stride + j] += value;
+        if (col_data != nullptr)
+            col_data[(size_t)j * col_stride + i] += value;
     }
 
-    Vector getCol(int j)
+    // add() for cells other threads may be adding to at the same time
+    inline void atomicAdd(int i, int j, T value)
     {
-        Vector result = Vector(rows);
-        for (int i = 0; i < rows; i++)
-        {
-            result.set(i, get(i, j));
-        }
-        return result;
+        std::atomic_ref<T>(data[(size_t)i * stride + j]).fetch_add(value, std::memory_order_relaxed);
+        if (col_data != nullptr)
+            std::atomic_ref<T>(col_data[(size_t)j * col_stride + i]).fetch_add(value, std::memory_order_relaxed);
+    }
+
+    inline T *rowPtr(int i)
+    {
+        return data + (size_t)i * stride;
+    }
+
+    inline const T *rowPtr(int i) const
+    {
+        return data + (size_t)i * stride;
+    }
+
+    // Build (or rebuild) the column-major copy. Worth it whenever columns are
+    // read more than once, e.g. B in a product or the answer check.
+    void cacheColumns()
+    {
+        std::free(col_data);
+        col_stride = alignedStride<T>(rows);
+        col_data = allocAligned<T>((size_t)cols * col_stride);
+        const int BLOCK = MATRIX_ALIGNMENT / sizeof(T);
+        for (int ii = 0; ii < rows; ii += BLOCK)
+            for (int jj = 0; jj < cols; jj += BLOCK)
+                for (int i = ii; i < std::min(ii + BLOCK, rows); i++)
+                    for (int j = jj; j < std::min(jj + BLOCK, cols); j++)
+                        col_data[(size_t)j * col_stride + i] = data[(size_t)i * stride + j];
+    }
+
+    void dropColumnCache()
+    {
+        std::free(col_data);
+        col_data = nullptr;
+        col_stride = 0;
+    }
+
+    inline bool hasColumnCache() const
+    {
+        return col_data != nullptr;
+    }
+
+    BasicVectorView<T> getRow(int i) const
+    {
+        return BasicVectorView<T>(rowPtr(i), cols, 1);
+    }
+
+    BasicVectorView<T> getCol(int j) const
+    {
+        if (col_data != nullptr)
+            return BasicVectorView<T>(col_data + (size_t)j * col_stride, rows, 1);
+        return BasicVectorView<T>(data + j, rows, stride);
     }
 
-    Matrix operator+(Matrix &other)
+    BasicMatrix operator+(const BasicMatrix &other) const
     {
-        Matrix result(rows, cols);
+        BasicMatrix result(rows, cols);
         for (int i = 0; i < rows; i++)
         {
             for (int j = 0; j < cols; j++)
@@ -172,66 +579,110 @@ public:
         return result;
     }
 
-    Matrix operator*(Matrix &other)
+    // blocked product, see gemm.hpp
+    BasicMatrix operator*(const BasicMatrix &other) const
     {
-        Matrix result(rows, other.cols);
-        for (int i = 0; i < rows; i++)
-        {
-            for (int j = 0; j < other.cols; j++)
-            {
-                int sum = 0;
-                for (int k = 0; k < cols; k++)
-                {
-                    sum += get(i, k) * other.get(k, j);
-                }
-                result.set(i, j, sum);
-            }
-        }
+        BasicMatrix result(rows, other.cols);
+        if constexpr (std::is_same<T, int>::value)
+            gemm<int>(rows, other.cols, cols, rowPtr(0), stride, other.rowPtr(0), other.stride, result.rowPtr(0), result.stride);
+        else
+            gemmGeneric<T>(rows, other.cols, cols, rowPtr(0), stride, other.rowPtr(0), other.stride, result.rowPtr(0), result.stride);
         return result;
     }
 };
 
+typedef BasicMatrix<long long> LongMatrix;
+
+// Product tile of several row vectors against several column vectors (all
+// the same length), e.g. k masked rows by k masked columns for one task.
+inline LongMatrix dotBlock(const std::vector<const BasicVector<int> *> &rows, const std::vector<const BasicVector<int> *> &cols)
+{
+    std::vector<const int32_t *> row_data, col_data;
+    int bound_rows = 0, bound_cols = 0;
+    for (auto v : rows)
+    {
+        row_data.push_back(v->data);
+        bound_rows = std::max(bound_rows, v->range());
+    }
+    for (auto v : cols)
+    {
+        col_data.push_back(v->data);
+        bound_cols = std::max(bound_cols, v->range());
+    }
+    LongMatrix result(rows.size(), cols.size());
+    int n = rows.empty() ? 0 : rows[0]->size;
+    dotBlock(rows.size(), row_data.data(), cols.size(), col_data.data(), n, result.rowPtr(0), result.stride, bound_rows, bound_cols);
+    return result;
+}
+
+typedef BasicVectorView<int> VectorView;
+typedef BasicVector<int> Vector;
+typedef BasicVector<long long> LongVector;
+typedef BasicVector<uint64_t> RingVector;
+typedef BasicVector<float> FloatVector;
+typedef BasicVector<double> DoubleVector;
+
+typedef BasicMatrix<int> Matrix;
+typedef BasicMatrix<uint64_t> RingMatrix;
+typedef BasicMatrix<float> FloatMatrix;
+typedef BasicMatrix<double> DoubleMatrix;
+
 const int MAX_VALUE = 1000;
 // const int SIZE = 2000; // should not use
 const int VECTOR_SIZE = 100;
 const int SHUFFLE_SIZE = 16;
 
+// Every random object draws from its own stream of a counter-based
+// generator (see rng.hpp), so the values only depend on _seed and the order
+// objects are created in, not on how many threads fill them.
 auto _seed = std::chrono::high_resolution_clock::now().time_since_epoch().count();
-auto _g = std::mt19937(_seed);
-auto _dist = std::uniform_int_distribution<int>(0, MAX_VALUE - 1);
+std::atomic<uint64_t> _stream(0);
 
-void randomVector(Vector &v)
+inline CounterRng nextRng()
 {
-    for (int i = 0; i < v.size; i++)
-    {
-        v.set(i, _dist(_g));
-    }
+    return CounterRng(_seed, _stream++);
 }
 
-Vector randomVector(int size)
+template <typename T>
+void randomVector(BasicVector<T> &v, const CounterRng &rng = nextRng())
 {
-    Vector result(size);
+    rng.fill(0, v.data, v.size, 0, MAX_VALUE - 1);
+    v.bound = MAX_VALUE - 1;
+}
+
+template <typename T = int>
+BasicVector<T> randomVector(int size)
+{
+    BasicVector<T> result(size);
     randomVector(result);
     return result;
 }
 
-Vector applyPerm(Vector &v, int perm[VECTOR_SIZE])
+template <typename T>
+BasicVector<T> applyPerm(BasicVector<T> &v, int perm[VECTOR_SIZE])
 {
-    Vector result(VECTOR_SIZE);
+    BasicVector<T> result(VECTOR_SIZE);
     for (int i = 0; i < v.size; i++)
         result.set(i, v.get(perm[i]));
+    result.bound = v.bound;
     return result;
 }
 
-Matrix randomMatrix(int rows, int cols)
+// Row i is words [i * cols, (i + 1) * cols) of the stream, so row bands are
+// filled in parallel and the result is the same for any thread count.
+template <typename T = int>
+BasicMatrix<T> randomMatrix(int rows, int cols, const CounterRng &rng = nextRng())
 {
-    Matrix result(rows, cols);
-    for (int i = 0; i < rows; i++)
+    BasicMatrix<T> result(rows, cols);
+    int grain = std::max(1, (1 << 16) / std::max(cols, 1));
+    auto fill_rows = [&](int lo, int hi)
     {
-        for (int j = 0; j < cols; j++)
-        {
-            result.set(i, j, _dist(_g));
-        }
-    }
+        for (int i = lo; i < hi; i++)
+            rng.fill((uint64_t)i * cols, result.rowPtr(i), cols, 0, MAX_VALUE - 1);
+    };
+    if (rows <= grain)
+        fill_rows(0, rows);
+    else
+        defaultPool().parallelFor(0, rows, grain, fill_rows);
     return result;
 }
@@ -0,0 +1,322 @@
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef MATRIX_FILE_HPP
+#define MATRIX_FILE_HPP
+#endif
+
+#ifndef MATHLIB_HPP
+#include "mathlib.hpp"
+#endif
+
+// Binary matrix files, little-endian:
+//
+//   offset  type      field
+//   0       char[8]   magic "DSPMATRX"
+//   8       uint32    version (MATRIX_FILE_VERSION)
+//   12      uint32    dtype (MatrixDtype)
+//   16      uint32    layout (0 = row-major)
+//   20      uint32    payload offset
+//   24      uint64    rows
+//   32      uint64    cols
+//   40      uint64    stride, in elements
+//   48      uint64    payload bytes (rows * stride * element size)
+//   56..    zero
+//
+// The payload starts one page in, and rows are padded to `stride` exactly
+// like BasicMatrix pads them. A file whose dtype matches can be mapped and
+// used in place, with no parsing and no copy.
+
+const char MATRIX_FILE_MAGIC[8] = {'D', 'S', 'P', 'M', 'A', 'T', 'R', 'X'};
+const uint32_t MATRIX_FILE_VERSION = 1;
+const uint32_t MATRIX_FILE_PAYLOAD = 4096;
+const uint32_t MATRIX_LAYOUT_ROW_MAJOR = 0;
+
+enum class MatrixDtype : uint32_t
+{
+    INT32 = 1,
+    INT64 = 2,
+    UINT64 = 3,
+    FLOAT32 = 4,
+    FLOAT64 = 5,
+};
+
+struct MatrixFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t layout;
+    uint32_t payload_offset;
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t stride;
+    uint64_t payload_bytes;
+};
+static_assert(sizeof(MatrixFileHeader) == 56, "matrix file header must stay packed");
+
+template <typename T>
+constexpr MatrixDtype matrixDtype()
+{
+    if constexpr (std::is_same<T, int>::value)
+        return MatrixDtype::INT32;
+    else if constexpr (std::is_same<T, long long>::value)
+        return MatrixDtype::INT64;
+    else if constexpr (std::is_same<T, uint64_t>::value)
+        return MatrixDtype::UINT64;
+    else if constexpr (std::is_same<T, float>::value)
+        return MatrixDtype::FLOAT32;
+    else
+        return MatrixDtype::FLOAT64;
+}
+
+inline size_t matrixDtypeSize(uint32_t dtype)
+{
+    switch ((MatrixDtype)dtype)
+    {
+    case MatrixDtype::INT32:
+    case MatrixDtype::FLOAT32:
+        return 4;
+    case MatrixDtype::INT64:
+    case MatrixDtype::UINT64:
+    case MatrixDtype::FLOAT64:
+        return 8;
+    }
+    return 0;
+}
+
+struct FileCloser
+{
+    int fd;
+    ~FileCloser()
+    {
+        close(fd);
+    }
+};
+
+// pread/pwrite until done; large transfers can come back short
+inline void readFully(int fd, void *buffer, size_t bytes, off_t offset)
+{
+    char *p = static_cast<char *>(buffer);
+    while (bytes > 0)
+    {
+        ssize_t got = pread(fd, p, bytes, offset);
+        if (got <= 0)
+            throw std::runtime_error("Failed to read matrix file");
+        p += got, offset += got, bytes -= got;
+    }
+}
+
+inline void writeFully(int fd, const void *buffer, size_t bytes, off_t offset)
+{
+    const char *p = static_cast<const char *>(buffer);
+    while (bytes > 0)
+    {
+        ssize_t put = pwrite(fd, p, bytes, offset);
+        if (put <= 0)
+            throw std::runtime_error("Failed to write matrix file");
+        p += put, offset += put, bytes -= put;
+    }
+}
+
+// whether v converts to T with its value unchanged
+template <typename T, typename S>
+bool convertsExactly(S v)
+{
+    if constexpr (std::is_integral<S>::value && std::is_integral<T>::value)
+        return std::in_range<T>(v);
+    else if constexpr (std::is_integral<T>::value)
+    {
+        const S limit = std::ldexp(S(1), std::numeric_limits<T>::digits); // 2^digits, exact in S
+        return v >= (std::is_signed<T>::value ? -limit : S(0)) && v < limit && std::trunc(v) == v;
+    }
+    else if constexpr (std::is_integral<S>::value)
+    {
+        // integers up to 2^digits are exact in T
+        uint64_t magnitude = (v < 0) ? -(uint64_t)v : (uint64_t)v;
+        return magnitude <= (1ULL << std::numeric_limits<T>::digits);
+    }
+    else
+        return !std::isfinite(v) || (std::abs(v) <= std::numeric_limits<T>::max() && (S)(T)v == v);
+}
+
+inline MatrixFileHeader readMatrixHeader(int fd, const std::string &path)
+{
+    MatrixFileHeader header;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header))
+        throw std::runtime_error("Not a matrix file: " + path);
+    readFully(fd, &header, sizeof(header), 0);
+    if (std::memcmp(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic)) != 0)
+        throw std::runtime_error("Not a matrix file: " + path);
+    if (header.version != MATRIX_FILE_VERSION || header.layout != MATRIX_LAYOUT_ROW_MAJOR)
+        throw std::runtime_error("Unsupported matrix file version or layout: " + path);
+    // sizes come from the file, so every product and sum is checked: one
+    // that wraps could pass and map less than the loader then reads
+    size_t element = matrixDtypeSize(header.dtype);
+    uint64_t elements, payload_bytes, file_end;
+    if (element == 0 || header.rows > INT_MAX || header.cols > INT_MAX || header.stride > INT_MAX ||
+        header.stride < header.cols || header.payload_offset < sizeof(header) ||
+        __builtin_mul_overflow(header.rows, header.stride, &elements) ||
+        __builtin_mul_overflow(elements, (uint64_t)element, &payload_bytes) ||
+        header.payload_bytes != payload_bytes ||
+        __builtin_add_overflow((uint64_t)header.payload_offset, header.payload_bytes, &file_end) ||
+        (uint64_t)st.st_size < file_end)
+        throw std::runtime_error("Corrupt matrix file: " + path);
+    return header;
+}
+
+// Loads a matrix file. With `map` and a matching dtype the file is mapped
+// copy-on-write and used in place; otherwise row bands are read (and
+// converted to T) in parallel. Throws if a value does not fit in T.
+template <typename T>
+BasicMatrix<T> loadMatrix(const std::string &path, bool map = true)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open matrix file: " + path);
+    FileCloser closer{fd};
+
+    MatrixFileHeader header = readMatrixHeader(fd, path);
+    const int rows = header.rows, cols = header.cols, stride = header.stride;
+    const size_t file_size = header.payload_offset + header.payload_bytes;
+
+    if (map && header.dtype == (uint32_t)matrixDtype<T>() && header.payload_offset % MATRIX_ALIGNMENT == 0 &&
+        stride * sizeof(T) % MATRIX_ALIGNMENT == 0 && header.payload_bytes > 0)
+    {
+        void *base = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (base != MAP_FAILED)
+        {
+            madvise(base, file_size, MADV_WILLNEED);
+            std::shared_ptr<void> backing(base, [file_size](void *p)
+                                          { munmap(p, file_size); });
+            T *data = reinterpret_cast<T *>(static_cast<char *>(base) + header.payload_offset);
+
+            // fault the pages in from several threads
+            const size_t page = 4096, bytes = header.payload_bytes;
+            const int bands = (int)std::min<size_t>(64 * defaultPool().size(), (bytes + page - 1) / page);
+            defaultPool().parallelFor(0, bands, 1, [&](int lo, int hi)
+                                      {
+                volatile const char *p = reinterpret_cast<const char *>(data);
+                for (size_t off = bytes * lo / bands; off < bytes * hi / bands; off += page)
+                    (void)p[off]; });
+            return BasicMatrix<T>(rows, cols, stride, data, std::move(backing));
+        }
+    }
+
+    BasicMatrix<T> result(rows, cols);
+    const size_t element = matrixDtypeSize(header.dtype);
+    const size_t row_bytes = (size_t)stride * element;
+    const int grain = std::max<int>(1, (4 << 20) / std::max<size_t>(row_bytes, 1));
+    auto load_band = [&](int lo, int hi)
+    {
+        std::unique_ptr<char[]> band(new char[(hi - lo) * row_bytes]);
+        readFully(fd, band.get(), (hi - lo) * row_bytes, header.payload_offset + lo * row_bytes);
+        auto convert = [&]<typename S>()
+        {
+            for (int i = lo; i < hi; i++)
+            {
+                const S *src = reinterpret_cast<const S *>(band.get() + (i - lo) * row_bytes);
+                T *dst = result.rowPtr(i);
+                for (int j = 0; j < cols; j++)
+                {
+                    if (!convertsExactly<T>(src[j]))
+                        throw std::runtime_error("Value at (" + std::to_string(i) + ", " + std::to_string(j) +
+                                                 ") does not fit the requested type: " + path);
+                    dst[j] = (T)src[j];
+                }
+            }
+        };
+        switch ((MatrixDtype)header.dtype)
+        {
+        case MatrixDtype::INT32:
+            convert.template operator()<int>();
+            break;
+        case MatrixDtype::INT64:
+            convert.template operator()<long long>();
+            break;
+        case MatrixDtype::UINT64:
+            convert.template operator()<uint64_t>();
+            break;
+        case MatrixDtype::FLOAT32:
+            convert.template operator()<float>();
+            break;
+        case MatrixDtype::FLOAT64:
+            convert.template operator()<double>();
+            break;
+        }
+    };
+    // pool tasks must not throw; the first error is thrown once all are done
+    std::mutex error_mtx;
+    std::string error;
+    defaultPool().parallelFor(0, rows, grain, [&](int lo, int hi)
+                              {
+        try
+        {
+            load_band(lo, hi);
+        }
+        catch (const std::exception &e)
+        {
+            std::lock_guard<std::mutex> lck(error_mtx);
+            if (error.empty())
+                error = e.what();
+        } });
+    if (!error.empty())
+        throw std::runtime_error(error);
+    return result;
+}
+
+// Writes M in the same format; row bands are written in parallel.
+template <typename T>
+void saveMatrix(const BasicMatrix<T> &M, const std::string &path)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Cannot create matrix file: " + path);
+    FileCloser closer{fd};
+
+    MatrixFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+    header.version = MATRIX_FILE_VERSION;
+    header.dtype = (uint32_t)matrixDtype<T>();
+    header.layout = MATRIX_LAYOUT_ROW_MAJOR;
+    header.payload_offset = MATRIX_FILE_PAYLOAD;
+    header.rows = M.rows;
+    header.cols = M.cols;
+    header.stride = alignedStride<T>(M.cols);
+    header.payload_bytes = header.rows * header.stride * sizeof(T);
+
+    char page[MATRIX_FILE_PAYLOAD] = {};
+    std::memcpy(page, &header, sizeof(header));
+    writeFully(fd, page, sizeof(page), 0);
+    if (ftruncate(fd, header.payload_offset + header.payload_bytes) != 0)
+        throw std::runtime_error("Failed to write matrix file: " + path);
+
+    const size_t row_bytes = header.stride * sizeof(T);
+    const int grain = std::max<int>(1, (4 << 20) / std::max<size_t>(row_bytes, 1));
+    defaultPool().parallelFor(0, M.rows, grain, [&](int lo, int hi)
+                              {
+        off_t offset = header.payload_offset + lo * row_bytes;
+        if ((size_t)M.stride == header.stride)
+        {
+            writeFully(fd, M.rowPtr(lo), (hi - lo) * row_bytes, offset);
+            return;
+        }
+        std::unique_ptr<T[]> band(new T[(size_t)(hi - lo) * header.stride]());
+        for (int i = lo; i < hi; i++)
+            std::copy(M.rowPtr(i), M.rowPtr(i) + M.cols, band.get() + (size_t)(i - lo) * header.stride);
+        writeFully(fd, band.get(), (hi - lo) * row_bytes, offset); });
+}
@@ -0,0 +1,172 @@
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <immintrin.h>
+
+#ifndef PACKING_HPP
+#define PACKING_HPP
+#endif
+
+#ifndef GEMM_HPP
+#include "gemm.hpp"
+#endif
+
+// Compact integer encodings for operands on the wire.
+//
+// Bit-packing with a frame of reference: a block of values is stored as
+// v - ref in `bits` bits each, where ref is the smallest value and bits is
+// just enough for the largest minus the smallest. Values follow each other
+// LSB first in one little-endian bit stream. Unsigned LEB128 varints carry
+// small non-negative integers such as the gaps between sparse indices.
+//
+// A packed block is: int32 ref, uint8 bits, uint32 count, packed values.
+
+const size_t PACKED_HEADER = 9;
+
+// bits needed for every value in [0, range]
+inline int packWidth(uint32_t range)
+{
+    return range == 0 ? 0 : 32 - __builtin_clz(range);
+}
+
+inline size_t packedBytes(size_t n, int bits)
+{
+    return (n * bits + 7) / 8;
+}
+
+// appends v[i] - ref, `bits` bits each
+inline void packBits(const int32_t *v, size_t n, int32_t ref, int bits, std::string &out)
+{
+    size_t start = out.size();
+    out.resize(start + packedBytes(n, bits), '\0');
+    if (bits == 0)
+        return;
+    unsigned char *p = reinterpret_cast<unsigned char *>(out.data()) + start;
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        acc |= (uint64_t)((uint32_t)v[i] - (uint32_t)ref) << filled;
+        filled += bits;
+        while (filled >= 8)
+        {
+            *p++ = (unsigned char)acc;
+            acc >>= 8;
+            filled -= 8;
+        }
+    }
+    if (filled > 0)
+        *p = (unsigned char)acc;
+}
+
+// Eight values per step: gather the 64-bit word holding each one, shift
+// and mask. Stops while the last load still stays inside `bytes`; returns
+// how many values it did.
+__attribute__((target("avx512f"))) inline size_t unpackBits512(const unsigned char *p, size_t bytes, size_t n, int32_t ref, int bits, int32_t *out)
+{
+    const __m512i lane_bits = _mm512_setr_epi64(0, bits, 2 * bits, 3 * bits, 4 * bits, 5 * bits, 6 * bits, 7 * bits);
+    const __m512i mask = _mm512_set1_epi64((1ULL << bits) - 1), seven = _mm512_set1_epi64(7);
+    const __m256i vref = _mm256_set1_epi32(ref);
+    size_t i = 0;
+    for (; i + 8 <= n && (((i + 7) * bits) >> 3) + 8 <= bytes; i += 8)
+    {
+        __m512i pos = _mm512_add_epi64(_mm512_set1_epi64((long long)(i * bits)), lane_bits);
+        __m512i words = _mm512_i64gather_epi64(_mm512_srli_epi64(pos, 3), (const void *)p, 1);
+        __m512i values = _mm512_and_si512(_mm512_srlv_epi64(words, _mm512_and_si512(pos, seven)), mask);
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi32(_mm512_cvtepi64_epi32(values), vref));
+    }
+    return i;
+}
+
+// out[i] = ref + the i-th `bits`-bit value of p
+inline void unpackBits(const unsigned char *p, size_t bytes, size_t n, int32_t ref, int bits, int32_t *out)
+{
+    if (bits == 0)
+    {
+        std::fill(out, out + n, ref);
+        return;
+    }
+    size_t i = 0;
+    if (n >= 16 && cpuFeatures().avx512f)
+        i = unpackBits512(p, bytes, n, ref, bits, out);
+    const uint64_t mask = (1ULL << bits) - 1;
+    for (; i < n; i++)
+    {
+        size_t bit = i * bits, byte = bit >> 3;
+        uint64_t word = 0;
+        std::memcpy(&word, p + byte, std::min<size_t>(8, bytes - byte));
+        out[i] = (int32_t)((uint32_t)ref + (uint32_t)((word >> (bit & 7)) & mask));
+    }
+}
+
+inline void putVarint(uint32_t x, std::string &out)
+{
+    while (x >= 0x80)
+    {
+        out += (char)(x | 0x80);
+        x >>= 7;
+    }
+    out += (char)x;
+}
+
+inline bool getVarint(std::string_view &s, uint32_t &x)
+{
+    x = 0;
+    for (int shift = 0; shift < 35 && !s.empty(); shift += 7)
+    {
+        unsigned char c = s.front();
+        s.remove_prefix(1);
+        x |= (uint32_t)(c & 0x7F) << shift;
+        if (c < 0x80)
+            return true;
+    }
+    return false;
+}
+
+inline void packVector(const int32_t *v, size_t n, std::string &out)
+{
+    int32_t lo = 0, hi = 0;
+    if (n > 0)
+    {
+        auto [min_it, max_it] = std::minmax_element(v, v + n);
+        lo = *min_it, hi = *max_it;
+    }
+    int bits = packWidth((uint32_t)hi - (uint32_t)lo);
+    uint32_t count = n;
+    out.append(reinterpret_cast<const char *>(&lo), sizeof(lo));
+    out += (char)bits;
+    out.append(reinterpret_cast<const char *>(&count), sizeof(count));
+    packBits(v, n, lo, bits, out);
+}
+
+// number of values in a packed block, or -1 if it is malformed
+inline long long packedCount(std::string_view s)
+{
+    if (s.size() < PACKED_HEADER || (unsigned char)s[4] > 32)
+        return -1;
+    uint32_t count;
+    std::memcpy(&count, s.data() + 5, sizeof(count));
+    if (s.size() - PACKED_HEADER < packedBytes(count, (unsigned char)s[4]))
+        return -1;
+    return count;
+}
+
+// Decodes a packed block into out[0 .. packedCount(s)). Returns the bytes
+// it took (0 if malformed) and an upper bound on |value| in `bound`.
+inline size_t unpackVector(std::string_view s, int32_t *out, int &bound)
+{
+    long long count = packedCount(s);
+    if (count < 0)
+        return 0;
+    int32_t ref;
+    std::memcpy(&ref, s.data(), sizeof(ref));
+    int bits = (unsigned char)s[4];
+    size_t bytes = packedBytes(count, bits);
+    unpackBits(reinterpret_cast<const unsigned char *>(s.data()) + PACKED_HEADER, bytes, count, ref, bits, out);
+    long long top = (long long)ref + (bits == 0 ? 0 : (1LL << bits) - 1);
+    bound = (int)std::min<long long>(INT32_MAX, std::max(std::llabs(ref), std::llabs(std::min<long long>(top, INT32_MAX))));
+    return PACKED_HEADER + bytes;
+}
@@ -0,0 +1,222 @@
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <immintrin.h>
+
+#ifndef RNG_HPP
+#define RNG_HPP
+#endif
+
+#ifndef GEMM_HPP
+#include "gemm.hpp"
+#endif
+
+// Counter-based random numbers (Philox4x32-10). There is no hidden state:
+// word `offset` of stream `stream` under `seed` is a pure function of those
+// three values. Any slice of a random matrix or mask can be generated on
+// its own, in any order, from any thread, and always comes out the same.
+//
+// Each Philox block turns a 128-bit counter into four 32-bit words. Words
+// are laid out in groups of 64 (16 blocks x 4 words), word-major:
+//   offset = 64 * g + 16 * w + lane  ->  word w of block 16 * g + lane
+// This lets the SIMD kernels compute 16 blocks side by side and store each
+// output word with one contiguous store.
+
+const uint32_t PHILOX_M0 = 0xD2511F53;
+const uint32_t PHILOX_M1 = 0xCD9E8D57;
+const uint32_t PHILOX_W0 = 0x9E3779B9;
+const uint32_t PHILOX_W1 = 0xBB67AE85;
+const int PHILOX_ROUNDS = 10;
+const int RNG_GROUP = 64;
+
+inline void philoxBlock(uint32_t ctr[4], uint32_t k0, uint32_t k1)
+{
+    for (int r = 0; r < PHILOX_ROUNDS; r++)
+    {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+        uint32_t c0 = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[0] = c0;
+        ctr[1] = (uint32_t)p1;
+        ctr[2] = c2;
+        ctr[3] = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+}
+
+// maps a uniform 32-bit word onto [lo, lo + range) by multiply-shift; the
+// bias is at most range / 2^32
+inline int32_t rngBounded(uint32_t x, int32_t lo, uint64_t range)
+{
+    return (int32_t)((uint32_t)lo + (uint32_t)((x * range) >> 32));
+}
+
+// high 32 bits of 16 unsigned 32x32 products
+__attribute__((target("avx512f"))) inline __m512i philoxMulHi512(__m512i a, __m512i m)
+{
+    __m512i even = _mm512_mul_epu32(a, m);
+    __m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(a, 32), m);
+    return _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32), odd);
+}
+
+// `groups` full groups of 64 words starting at block `block`
+__attribute__((target("avx512f"))) inline void philoxFill512(uint64_t block, uint64_t stream, uint32_t key0, uint32_t key1, int32_t *out, size_t groups, int32_t lo, uint64_t range)
+{
+    const __m512i m0 = _mm512_set1_epi32(PHILOX_M0), m1 = _mm512_set1_epi32(PHILOX_M1);
+    const __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i s0 = _mm512_set1_epi32((uint32_t)stream), s1 = _mm512_set1_epi32((uint32_t)(stream >> 32));
+    const __m512i vlo = _mm512_set1_epi32(lo), vrange = _mm512_set1_epi32((uint32_t)range);
+    for (size_t g = 0; g < groups; g++, block += 16, out += RNG_GROUP)
+    {
+        __m512i base = _mm512_set1_epi32((uint32_t)block);
+        __m512i c0 = _mm512_add_epi32(base, iota);
+        // carry into the high counter word for lanes that wrapped
+        __mmask16 wrapped = _mm512_cmplt_epu32_mask(c0, base);
+        __m512i high = _mm512_set1_epi32((uint32_t)(block >> 32));
+        __m512i c1 = _mm512_mask_add_epi32(high, wrapped, high, _mm512_set1_epi32(1));
+        __m512i c2 = s0, c3 = s1;
+        uint32_t k0 = key0, k1 = key1;
+        for (int r = 0; r < PHILOX_ROUNDS; r++)
+        {
+            __m512i hi0 = philoxMulHi512(c0, m0), lo0 = _mm512_mullo_epi32(c0, m0);
+            __m512i hi1 = philoxMulHi512(c2, m1), lo1 = _mm512_mullo_epi32(c2, m1);
+            c0 = _mm512_xor_si512(_mm512_xor_si512(hi1, c1), _mm512_set1_epi32(k0));
+            c1 = lo1;
+            c2 = _mm512_xor_si512(_mm512_xor_si512(hi0, c3), _mm512_set1_epi32(k1));
+            c3 = lo0;
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        __m512i words[4] = {c0, c1, c2, c3};
+        for (int w = 0; w < 4; w++)
+        {
+            __m512i x = words[w];
+            if (range <= UINT32_MAX)
+                x = _mm512_add_epi32(vlo, philoxMulHi512(x, vrange));
+            _mm512_storeu_si512((void *)(out + 16 * w), x);
+        }
+    }
+}
+
+__attribute__((target("avx2"))) inline __m256i philoxMulHi256(__m256i a, __m256i m)
+{
+    __m256i even = _mm256_mul_epu32(a, m);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    return _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+// same as philoxFill512, as two 8-lane halves per group
+__attribute__((target("avx2"))) inline void philoxFill256(uint64_t block, uint64_t stream, uint32_t key0, uint32_t key1, int32_t *out, size_t groups, int32_t lo, uint64_t range)
+{
+    const __m256i m0 = _mm256_set1_epi32(PHILOX_M0), m1 = _mm256_set1_epi32(PHILOX_M1);
+    const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i vlo = _mm256_set1_epi32(lo), vrange = _mm256_set1_epi32((uint32_t)range);
+    for (size_t g = 0; g < groups; g++, out += RNG_GROUP)
+    {
+        for (int half = 0; half < 2; half++, block += 8)
+        {
+            // 8-lane compares are signed; flip the sign bit to compare unsigned
+            const __m256i flip = _mm256_set1_epi32(INT32_MIN);
+            __m256i base = _mm256_set1_epi32((uint32_t)block);
+            __m256i c0 = _mm256_add_epi32(base, iota);
+            __m256i wrapped = _mm256_cmpgt_epi32(_mm256_xor_si256(base, flip), _mm256_xor_si256(c0, flip));
+            __m256i c1 = _mm256_sub_epi32(_mm256_set1_epi32((uint32_t)(block >> 32)), wrapped);
+            __m256i c2 = _mm256_set1_epi32((uint32_t)stream), c3 = _mm256_set1_epi32((uint32_t)(stream >> 32));
+            uint32_t k0 = key0, k1 = key1;
+            for (int r = 0; r < PHILOX_ROUNDS; r++)
+            {
+                __m256i hi0 = philoxMulHi256(c0, m0), lo0 = _mm256_mullo_epi32(c0, m0);
+                __m256i hi1 = philoxMulHi256(c2, m1), lo1 = _mm256_mullo_epi32(c2, m1);
+                c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), _mm256_set1_epi32(k0));
+                c1 = lo1;
+                c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), _mm256_set1_epi32(k1));
+                c3 = lo0;
+                k0 += PHILOX_W0;
+                k1 += PHILOX_W1;
+            }
+            __m256i words[4] = {c0, c1, c2, c3};
+            for (int w = 0; w < 4; w++)
+            {
+                __m256i x = words[w];
+                if (range <= UINT32_MAX)
+                    x = _mm256_add_epi32(vlo, philoxMulHi256(x, vrange));
+                _mm256_storeu_si256((__m256i *)(out + 16 * w + 8 * half), x);
+            }
+        }
+    }
+}
+
+class CounterRng
+{
+public:
+    uint64_t seed;
+    uint64_t stream;
+
+    CounterRng(uint64_t seed = 0, uint64_t stream = 0)
+    {
+        this->seed = seed;
+        this->stream = stream;
+    }
+
+    // an independent generator under the same seed
+    CounterRng substream(uint64_t stream) const
+    {
+        return CounterRng(seed, stream);
+    }
+
+    uint32_t at(uint64_t offset) const
+    {
+        uint64_t block = offset / RNG_GROUP * 16 + offset % 16;
+        uint32_t ctr[4] = {(uint32_t)block, (uint32_t)(block >> 32), (uint32_t)stream, (uint32_t)(stream >> 32)};
+        philoxBlock(ctr, (uint32_t)seed, (uint32_t)(seed >> 32));
+        return ctr[(offset / 16) % 4];
+    }
+
+    // out[i] = uniform in [lo, hi] (inclusive, like uniform_int_distribution)
+    // for words offset .. offset + n - 1
+    void fill(uint64_t offset, int32_t *out, size_t n, int32_t lo, int32_t hi) const
+    {
+        uint64_t range = (uint64_t)((int64_t)hi - lo) + 1;
+        auto word = [&](uint64_t o)
+        {
+            uint32_t x = at(o);
+            return range > UINT32_MAX ? (int32_t)x : rngBounded(x, lo, range);
+        };
+
+        size_t i = 0;
+        for (; i < n && (offset + i) % RNG_GROUP != 0; i++)
+            out[i] = word(offset + i);
+        size_t groups = (n - i) / RNG_GROUP;
+        if (groups > 0)
+        {
+            uint64_t block = (offset + i) / RNG_GROUP * 16;
+            const CpuFeatures &cpu = cpuFeatures();
+            if (cpu.avx512f)
+                philoxFill512(block, stream, (uint32_t)seed, (uint32_t)(seed >> 32), out + i, groups, lo, range);
+            else if (cpu.avx2)
+                philoxFill256(block, stream, (uint32_t)seed, (uint32_t)(seed >> 32), out + i, groups, lo, range);
+            else
+                for (size_t k = 0; k < groups * RNG_GROUP; k++)
+                    out[i + k] = word(offset + i + k);
+            i += groups * RNG_GROUP;
+        }
+        for (; i < n; i++)
+            out[i] = word(offset + i);
+    }
+
+    // other element types go through a small int32 buffer
+    template <typename T>
+    void fill(uint64_t offset, T *out, size_t n, int32_t lo, int32_t hi) const
+    {
+        int32_t buffer[4 * RNG_GROUP];
+        for (size_t i = 0; i < n; i += 4 * RNG_GROUP)
+        {
+            size_t count = std::min<size_t>(4 * RNG_GROUP, n - i);
+            fill(offset + i, buffer, count, lo, hi);
+            for (size_t k = 0; k < count; k++)
+                out[i + k] = (T)buffer[k];
+        }
+    }
+};
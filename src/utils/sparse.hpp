@@ -0,0 +1,334 @@
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+
+#ifndef SPARSE_HPP
+#define SPARSE_HPP
+#endif
+
+#ifndef MATHLIB_HPP
+#include "mathlib.hpp"
+#endif
+
+// Sparse vectors and compressed (CSR / CSC) matrices. Indices are sorted
+// and unique within a vector; values of zero may still be stored.
+
+// Sum of a[i] * b[i] over the indices both sides have. A plain merge when
+// the two are about the same length, galloping through the longer one when
+// they are not.
+template <typename T>
+typename ElementTraits<T>::acc_type sparseDot(const int *ia, const T *va, int na, const int *ib, const T *vb, int nb)
+{
+    typedef typename ElementTraits<T>::acc_type Acc;
+    if (na > nb)
+        return sparseDot(ib, vb, nb, ia, va, na);
+    Acc result = 0;
+    if (na == 0)
+        return result;
+    if ((long long)na * 16 < nb)
+    {
+        const int *lo = ib;
+        for (int i = 0; i < na; i++)
+        {
+            // gallop to bracket ia[i], then binary search inside
+            int step = 1;
+            const int *hi = lo;
+            while (hi < ib + nb && *hi < ia[i])
+            {
+                lo = hi;
+                hi = std::min(hi + step, ib + nb);
+                step *= 2;
+            }
+            lo = std::lower_bound(lo, std::min(hi + 1, ib + nb), ia[i]);
+            if (lo == ib + nb)
+                break;
+            if (*lo == ia[i])
+                result += (Acc)va[i] * vb[lo - ib];
+        }
+        return result;
+    }
+    int i = 0, j = 0;
+    while (i < na && j < nb)
+    {
+        if (ia[i] == ib[j])
+            result += (Acc)va[i++] * vb[j++];
+        else if (ia[i] < ib[j])
+            i++;
+        else
+            j++;
+    }
+    return result;
+}
+
+__attribute__((target("avx512f"))) inline long long sparseDenseDotAvx512(const int *index, const int32_t *value, int nnz, const int32_t *dense)
+{
+    __m512i acc0 = _mm512_setzero_si512(), acc1 = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 16 <= nnz; i += 16)
+    {
+        __m512i idx = _mm512_loadu_si512((const void *)(index + i));
+        __m512i x = _mm512_loadu_si512((const void *)(value + i));
+        __m512i y = _mm512_i32gather_epi32(idx, dense, 4);
+        acc0 = _mm512_add_epi64(acc0, _mm512_mul_epi32(x, y));
+        acc1 = _mm512_add_epi64(acc1, _mm512_mul_epi32(_mm512_srli_epi64(x, 32), _mm512_srli_epi64(y, 32)));
+    }
+    long long result = _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+    for (; i < nnz; i++)
+        result += (long long)value[i] * dense[index[i]];
+    return result;
+}
+
+// Sum of value[i] * dense[index[i]].
+template <typename T>
+typename ElementTraits<T>::acc_type sparseDenseDot(const int *index, const T *value, int nnz, const T *dense)
+{
+    typedef typename ElementTraits<T>::acc_type Acc;
+    if constexpr (std::is_same<T, int>::value)
+        if (nnz >= DOT_MIN_SIMD && cpuFeatures().avx512f)
+            return sparseDenseDotAvx512(index, value, nnz, dense);
+    Acc acc[4] = {};
+    int i = 0;
+    for (; i + 4 <= nnz; i += 4)
+        for (int l = 0; l < 4; l++)
+            acc[l] += (Acc)value[i + l] * dense[index[i + l]];
+    for (; i < nnz; i++)
+        acc[0] += (Acc)value[i] * dense[index[i]];
+    return acc[0] + acc[1] + acc[2] + acc[3];
+}
+
+// Non-owning window over one row of a CSR (or column of a CSC) matrix, or
+// over a whole sparse vector.
+template <typename T>
+class SparseVectorView
+{
+public:
+    typedef typename ElementTraits<T>::acc_type acc_type;
+
+    const int *index;
+    const T *value;
+    int nnz;
+    int size;
+
+    SparseVectorView(const int *index = nullptr, const T *value = nullptr, int nnz = 0, int size = 0)
+    {
+        this->index = index;
+        this->value = value;
+        this->nnz = nnz;
+        this->size = size;
+    }
+
+    acc_type dot(const SparseVectorView &other) const
+    {
+        return sparseDot(index, value, nnz, other.index, other.value, other.nnz);
+    }
+
+    acc_type dot(const BasicVector<T> &dense) const
+    {
+        return sparseDenseDot(index, value, nnz, dense.data);
+    }
+
+    // true if some index is stored on both sides
+    bool intersects(const SparseVectorView &other) const
+    {
+        int i = 0, j = 0;
+        while (i < nnz && j < other.nnz)
+        {
+            if (index[i] == other.index[j])
+                return true;
+            if (index[i] < other.index[j])
+                i++;
+            else
+                j++;
+        }
+        return false;
+    }
+};
+
+// Owning sparse vector. clear() keeps the capacity, so a vector that is
+// refilled for every task stops allocating once it has seen the largest.
+template <typename T>
+class BasicSparseVector
+{
+public:
+    typedef typename ElementTraits<T>::acc_type acc_type;
+
+    int size;
+    std::vector<int> index;
+    std::vector<T> value;
+
+    BasicSparseVector(int size = 0)
+    {
+        this->size = size;
+    }
+
+    // keeps the entries of a dense vector that are not zero
+    explicit BasicSparseVector(const BasicVectorView<T> &dense)
+    {
+        this->size = dense.size;
+        for (int i = 0; i < dense.size; i++)
+            if (dense.get(i) != 0)
+                push(i, dense.get(i));
+    }
+
+    int nnz() const
+    {
+        return index.size();
+    }
+
+    void clear(int size = 0)
+    {
+        this->size = size;
+        index.clear();
+        value.clear();
+    }
+
+    // indices must be pushed in increasing order
+    void push(int i, T v)
+    {
+        index.push_back(i);
+        value.push_back(v);
+    }
+
+    SparseVectorView<T> view() const
+    {
+        return SparseVectorView<T>(index.data(), value.data(), nnz(), size);
+    }
+
+    acc_type dot(const BasicSparseVector &other) const
+    {
+        return view().dot(other.view());
+    }
+
+    acc_type dot(const BasicVector<T> &dense) const
+    {
+        return view().dot(dense);
+    }
+};
+
+enum class SparseLayout
+{
+    CSR = 0, // compressed rows
+    CSC = 1, // compressed columns
+};
+
+// Compressed sparse matrix. major(i) is row i for CSR and column i for CSC;
+// ptr[i] .. ptr[i + 1] is its slice of index/value.
+template <typename T>
+class BasicCompressedMatrix
+{
+public:
+    int rows;
+    int cols;
+    SparseLayout layout;
+    std::vector<size_t> ptr;
+    std::vector<int> index;
+    std::vector<T> value;
+
+    BasicCompressedMatrix(int rows = 0, int cols = 0, SparseLayout layout = SparseLayout::CSR)
+    {
+        this->rows = rows;
+        this->cols = cols;
+        this->layout = layout;
+        this->ptr.assign(majorCount() + 1, 0);
+    }
+
+    static BasicCompressedMatrix fromDense(const BasicMatrix<T> &M, SparseLayout layout)
+    {
+        BasicCompressedMatrix result(M.rows, M.cols, SparseLayout::CSR);
+        for (int i = 0; i < M.rows; i++)
+        {
+            const T *row = M.rowPtr(i);
+            for (int j = 0; j < M.cols; j++)
+            {
+                if (row[j] != 0)
+                {
+                    result.index.push_back(j);
+                    result.value.push_back(row[j]);
+                }
+            }
+            result.ptr[i + 1] = result.index.size();
+        }
+        return layout == SparseLayout::CSR ? std::move(result) : result.convert();
+    }
+
+    int majorCount() const
+    {
+        return layout == SparseLayout::CSR ? rows : cols;
+    }
+
+    int minorCount() const
+    {
+        return layout == SparseLayout::CSR ? cols : rows;
+    }
+
+    size_t nnz() const
+    {
+        return index.size();
+    }
+
+    SparseVectorView<T> major(int i) const
+    {
+        return SparseVectorView<T>(index.data() + ptr[i], value.data() + ptr[i], ptr[i + 1] - ptr[i], minorCount());
+    }
+
+    // the same matrix in the other layout (CSR <-> CSC), by counting sort
+    BasicCompressedMatrix convert() const
+    {
+        SparseLayout other = layout == SparseLayout::CSR ? SparseLayout::CSC : SparseLayout::CSR;
+        BasicCompressedMatrix result(rows, cols, other);
+        for (int k : index)
+            result.ptr[k + 1]++;
+        for (int i = 0; i < minorCount(); i++)
+            result.ptr[i + 1] += result.ptr[i];
+        result.index.resize(nnz());
+        result.value.resize(nnz());
+        std::vector<size_t> next(result.ptr.begin(), result.ptr.end() - 1);
+        for (int i = 0; i < majorCount(); i++)
+        {
+            for (size_t p = ptr[i]; p < ptr[i + 1]; p++)
+            {
+                size_t q = next[index[p]]++;
+                result.index[q] = i;
+                result.value[q] = value[p];
+            }
+        }
+        return result;
+    }
+
+    BasicMatrix<T> toDense() const
+    {
+        BasicMatrix<T> result(rows, cols);
+        for (int i = 0; i < majorCount(); i++)
+            for (size_t p = ptr[i]; p < ptr[i + 1]; p++)
+            {
+                if (layout == SparseLayout::CSR)
+                    result.set(i, index[p], value[p]);
+                else
+                    result.set(index[p], i, value[p]);
+            }
+        return result;
+    }
+};
+
+typedef SparseVectorView<int> SparseView;
+typedef BasicSparseVector<int> SparseVector;
+typedef BasicCompressedMatrix<int> SparseMatrix;
+
+// Random matrix with about `density` of its entries non-zero. Which entries
+// survive is drawn from a second stream, so this stays reproducible.
+template <typename T = int>
+BasicMatrix<T> randomSparseMatrix(int rows, int cols, double density, const CounterRng &rng = nextRng())
+{
+    BasicMatrix<T> result = randomMatrix<T>(rows, cols, rng);
+    CounterRng keep = rng.substream(~rng.stream);
+    uint32_t threshold = (uint32_t)(std::clamp(density, 0.0, 1.0) * UINT32_MAX);
+    for (int i = 0; i < rows; i++)
+    {
+        T *row = result.rowPtr(i);
+        for (int j = 0; j < cols; j++)
+            if (keep.at((uint64_t)i * cols + j) >= threshold)
+                row[j] = 0;
+    }
+    return result;
+}
@@ -0,0 +1,229 @@
+#include <type_traits>
+
+#ifndef STRASSEN_HPP
+#define STRASSEN_HPP
+#endif
+
+#ifndef MATHLIB_HPP
+#include "mathlib.hpp"
+#endif
+
+// Strassen-Winograd multiplication: 7 half-size products and 15 additions per
+// level instead of 8 products. Only offered for int (mod 2^32, like the
+// blocked kernel) and the uint64 ring, where the extra subtractions are exact.
+//
+// With A and B split into quadrants:
+//   S1 = A21 + A22  S2 = S1 - A11  S3 = A11 - A21  S4 = A12 - S2
+//   T1 = B12 - B11  T2 = B22 - T1  T3 = B22 - B12  T4 = T2 - B21
+//   P1 = A11 B11  P2 = A12 B21  P3 = S4 B22  P4 = A22 T4
+//   P5 = S1 T1    P6 = S2 T2    P7 = S3 T3
+//   C11 = P1 + P2            C12 = P1 + P6 + P5 + P3
+//   C21 = P1 + P6 + P7 - P4  C22 = P1 + P6 + P7 + P5
+
+// below this size the blocked kernel is faster; tune per machine
+const int STRASSEN_CROSSOVER = 512;
+const int STRASSEN_PRODUCTS = 7;
+
+template <typename T>
+struct StrassenElement
+{
+    static constexpr bool value = std::is_same<T, int>::value || std::is_same<T, uint64_t>::value;
+};
+
+// Z = X + sign * Y over an m x n block, wrapping instead of overflowing.
+template <typename T>
+void blockAddSub(int m, int n, const T *X, int ldx, const T *Y, int ldy, T *Z, int ldz, int sign)
+{
+    typedef typename std::conditional<std::is_integral<T>::value, typename std::make_unsigned<T>::type, T>::type W;
+    for (int i = 0; i < m; i++)
+    {
+        const T *x = X + (size_t)i * ldx;
+        const T *y = Y + (size_t)i * ldy;
+        T *z = Z + (size_t)i * ldz;
+        if (sign > 0)
+            for (int j = 0; j < n; j++)
+                z[j] = (T)((W)x[j] + (W)y[j]);
+        else
+            for (int j = 0; j < n; j++)
+                z[j] = (T)((W)x[j] - (W)y[j]);
+    }
+}
+
+template <typename T>
+void strassenBase(int n, const T *A, int lda, const T *B, int ldb, T *C, int ldc)
+{
+    if constexpr (std::is_same<T, int>::value)
+        gemm<int>(n, n, n, A, lda, B, ldb, C, ldc);
+    else
+        gemmGeneric<T>(n, n, n, A, lda, B, ldb, C, ldc);
+}
+
+// C = A * B for square n x n blocks; n must halve evenly down to crossover.
+template <typename T>
+void strassenRec(int n, const T *A, int lda, const T *B, int ldb, T *C, int ldc, int crossover, Arena &scratch)
+{
+    if (n <= crossover || n % 2 != 0)
+    {
+        strassenBase(n, A, lda, B, ldb, C, ldc);
+        return;
+    }
+
+    const int h = n / 2;
+    const T *A11 = A, *A12 = A + h, *A21 = A + (size_t)h * lda, *A22 = A21 + h;
+    const T *B11 = B, *B12 = B + h, *B21 = B + (size_t)h * ldb, *B22 = B21 + h;
+    T *C11 = C, *C12 = C + h, *C21 = C + (size_t)h * ldc, *C22 = C21 + h;
+
+    Arena::Marker marker = scratch.mark();
+    T *S[4], *U[4], *P[STRASSEN_PRODUCTS];
+    for (int i = 0; i < 4; i++)
+    {
+        S[i] = scratch.allocate<T>((size_t)h * h);
+        U[i] = scratch.allocate<T>((size_t)h * h);
+    }
+    for (int i = 0; i < STRASSEN_PRODUCTS; i++)
+        P[i] = scratch.allocate<T>((size_t)h * h);
+
+    blockAddSub(h, h, A21, lda, A22, lda, S[0], h, 1);
+    blockAddSub(h, h, S[0], h, A11, lda, S[1], h, -1);
+    blockAddSub(h, h, A11, lda, A21, lda, S[2], h, -1);
+    blockAddSub(h, h, A12, lda, S[1], h, S[3], h, -1);
+    blockAddSub(h, h, B12, ldb, B11, ldb, U[0], h, -1);
+    blockAddSub(h, h, B22, ldb, U[0], h, U[1], h, -1);
+    blockAddSub(h, h, B22, ldb, B12, ldb, U[2], h, -1);
+    blockAddSub(h, h, U[1], h, B21, ldb, U[3], h, -1);
+
+    strassenRec(h, A11, lda, B11, ldb, P[0], h, crossover, scratch);
+    strassenRec(h, A12, lda, B21, ldb, P[1], h, crossover, scratch);
+    strassenRec(h, S[3], h, B22, ldb, P[2], h, crossover, scratch);
+    strassenRec(h, A22, lda, U[3], h, P[3], h, crossover, scratch);
+    strassenRec(h, S[0], h, U[0], h, P[4], h, crossover, scratch);
+    strassenRec(h, S[1], h, U[1], h, P[5], h, crossover, scratch);
+    strassenRec(h, S[2], h, U[2], h, P[6], h, crossover, scratch);
+
+    // S is free again; reuse it for the partial sums
+    T *P16 = S[0], *P167 = S[1], *P165 = S[2];
+    blockAddSub(h, h, P[0], h, P[1], h, C11, ldc, 1);
+    blockAddSub(h, h, P[0], h, P[5], h, P16, h, 1);
+    blockAddSub(h, h, P16, h, P[6], h, P167, h, 1);
+    blockAddSub(h, h, P16, h, P[4], h, P165, h, 1);
+    blockAddSub(h, h, P165, h, P[2], h, C12, ldc, 1);
+    blockAddSub(h, h, P167, h, P[3], h, C21, ldc, -1);
+    blockAddSub(h, h, P167, h, P[4], h, C22, ldc, 1);
+
+    scratch.rewind(marker);
+}
+
+// Smallest size >= n that halves evenly down to at most `crossover`.
+inline int strassenPaddedSize(int n, int crossover)
+{
+    int levels = 0;
+    while (n > crossover)
+    {
+        n = (n + 1) / 2;
+        levels++;
+    }
+    return n << levels;
+}
+
+// Recursive Strassen-Winograd product of square matrices, switching to the
+// blocked kernel below `crossover`. Non-square inputs fall back to operator*.
+template <typename T>
+BasicMatrix<T> strassenMul(const BasicMatrix<T> &A, const BasicMatrix<T> &B, int crossover = STRASSEN_CROSSOVER)
+{
+    static_assert(StrassenElement<T>::value, "Strassen is only exact for int and the uint64 ring");
+    const int n = A.rows;
+    if (A.cols != n || B.rows != n || B.cols != n || n <= crossover)
+        return A * B;
+
+    const int m = strassenPaddedSize(n, crossover);
+    Arena scratch((size_t)m * m * sizeof(T) * 2);
+    BasicMatrix<T> result(n, n);
+    if (m == n)
+    {
+        strassenRec(n, A.rowPtr(0), A.stride, B.rowPtr(0), B.stride, result.rowPtr(0), result.stride, crossover, scratch);
+        return result;
+    }
+
+    BasicMatrix<T> PA(m, m), PB(m, m), PC(m, m);
+    for (int i = 0; i < n; i++)
+    {
+        std::copy(A.rowPtr(i), A.rowPtr(i) + n, PA.rowPtr(i));
+        std::copy(B.rowPtr(i), B.rowPtr(i) + n, PB.rowPtr(i));
+    }
+    strassenRec(m, PA.rowPtr(0), PA.stride, PB.rowPtr(0), PB.stride, PC.rowPtr(0), PC.stride, crossover, scratch);
+    for (int i = 0; i < n; i++)
+        std::copy(PC.rowPtr(i), PC.rowPtr(i) + n, result.rowPtr(i));
+    return result;
+}
+
+// One level of the same recursion, for splitting a job into 7 independent
+// half-size products (e.g. across workers). A (n x k) and B (k x m) are cut
+// in half along each of their own dimensions; quadrants are zero-padded
+// where a dimension is odd.
+template <typename T>
+void strassenSplit(const BasicMatrix<T> &A, const BasicMatrix<T> &B, BasicMatrix<T> left[STRASSEN_PRODUCTS], BasicMatrix<T> right[STRASSEN_PRODUCTS])
+{
+    // quadrant (qi, qj) of X, of size (X.rows + 1) / 2 x (X.cols + 1) / 2
+    auto quadrant = [](const BasicMatrix<T> &X, int qi, int qj)
+    {
+        const int hr = (X.rows + 1) / 2, hc = (X.cols + 1) / 2;
+        BasicMatrix<T> Q(hr, hc);
+        for (int i = 0; i < hr && qi * hr + i < X.rows; i++)
+            for (int j = 0; j < hc && qj * hc + j < X.cols; j++)
+                Q.set(i, j, X.get(qi * hr + i, qj * hc + j));
+        return Q;
+    };
+    auto combine = [](const BasicMatrix<T> &X, const BasicMatrix<T> &Y, int sign)
+    {
+        BasicMatrix<T> Z(X.rows, X.cols);
+        blockAddSub(X.rows, X.cols, X.rowPtr(0), X.stride, Y.rowPtr(0), Y.stride, Z.rowPtr(0), Z.stride, sign);
+        return Z;
+    };
+
+    BasicMatrix<T> A11 = quadrant(A, 0, 0), A12 = quadrant(A, 0, 1), A21 = quadrant(A, 1, 0), A22 = quadrant(A, 1, 1);
+    BasicMatrix<T> B11 = quadrant(B, 0, 0), B12 = quadrant(B, 0, 1), B21 = quadrant(B, 1, 0), B22 = quadrant(B, 1, 1);
+    BasicMatrix<T> S1 = combine(A21, A22, 1), T1 = combine(B12, B11, -1);
+    BasicMatrix<T> S2 = combine(S1, A11, -1), T2 = combine(B22, T1, -1);
+
+    left[3] = std::move(A22);
+    left[2] = combine(A12, S2, -1);
+    left[6] = combine(A11, A21, -1);
+    left[0] = std::move(A11);
+    left[1] = std::move(A12);
+    left[4] = std::move(S1);
+    left[5] = std::move(S2);
+
+    right[3] = combine(T2, B21, -1);
+    right[6] = combine(B22, B12, -1);
+    right[0] = std::move(B11);
+    right[1] = std::move(B21);
+    right[2] = std::move(B22);
+    right[4] = std::move(T1);
+    right[5] = std::move(T2);
+}
+
+// Recombine the 7 products from strassenSplit into C (n x m), cropping the
+// padding. U may be wider than the split type, e.g. LongMatrix accumulators.
+template <typename U>
+void strassenJoin(const BasicMatrix<U> products[STRASSEN_PRODUCTS], BasicMatrix<U> &C)
+{
+    const int n = C.rows, m = C.cols;
+    const int hr = products[0].rows, hc = products[0].cols;
+    for (int i = 0; i < hr; i++)
+    {
+        for (int j = 0; j < hc; j++)
+        {
+            U p1 = products[0].get(i, j), p2 = products[1].get(i, j), p3 = products[2].get(i, j);
+            U p4 = products[3].get(i, j), p5 = products[4].get(i, j), p6 = products[5].get(i, j);
+            U p7 = products[6].get(i, j);
+            U p16 = p1 + p6, p167 = p16 + p7;
+            C.set(i, j, p1 + p2);
+            if (hc + j < m)
+                C.set(i, hc + j, p16 + p5 + p3);
+            if (hr + i < n)
+                C.set(hr + i, j, p167 - p4);
+            if (hr + i < n && hc + j < m)
+                C.set(hr + i, hc + j, p167 + p5);
+        }
+    }
+}
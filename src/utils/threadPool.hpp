@@ -0,0 +1,227 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+#endif
+
+#ifndef GEMM_HPP
+#include "gemm.hpp"
+#endif
+
+// Persistent work-stealing pool. Every worker owns a deque: it pushes and pops
+// its own work at the back (newest first, still warm in cache) and, when it
+// runs dry, steals the oldest task from the front of another worker's deque.
+// Threads that wait on a parallelFor run pending tasks instead of blocking,
+// so nested parallel loops cannot deadlock the pool.
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    ThreadPool(int threads = 0, bool pin = false)
+    {
+        if (threads <= 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (int i = 0; i < threads; i++)
+            queues.emplace_back(new Queue());
+        for (int i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this, i]()
+                                 { workerLoop(i); });
+            if (pin)
+                pinThread(workers.back(), i);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lck(sleep_mtx);
+            stopping = true;
+        }
+        sleep_cv.notify_all();
+        for (auto &t : workers)
+            t.join();
+    }
+
+    int size() const
+    {
+        return workers.size();
+    }
+
+    void submit(Task task)
+    {
+        int index = (current_pool == this) ? current_index : (int)(next_queue++ % queues.size());
+        {
+            std::lock_guard<std::mutex> lck(queues[index]->mtx);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        pending++;
+        {
+            std::lock_guard<std::mutex> lck(sleep_mtx);
+        }
+        sleep_cv.notify_one();
+    }
+
+    // fn(lo, hi) over [begin, end) in chunks of at most `grain`; returns when
+    // every chunk is done.
+    template <typename F>
+    void parallelFor(int begin, int end, int grain, F fn)
+    {
+        if (end <= begin)
+            return;
+        grain = std::max(1, grain);
+        std::atomic<int> remaining((end - begin + grain - 1) / grain);
+        for (int lo = begin; lo < end; lo += grain)
+        {
+            int hi = std::min(end, lo + grain);
+            submit([&fn, &remaining, lo, hi]()
+                   { fn(lo, hi); remaining--; });
+        }
+        waitFor(remaining);
+    }
+
+    // fn(r0, r1, c0, c1) over a rows x cols grid cut into tiles.
+    template <typename F>
+    void parallelFor2D(int rows, int cols, int tile_rows, int tile_cols, F fn)
+    {
+        if (rows <= 0 || cols <= 0)
+            return;
+        int row_tiles = (rows + tile_rows - 1) / tile_rows;
+        int col_tiles = (cols + tile_cols - 1) / tile_cols;
+        parallelFor(0, row_tiles * col_tiles, 1, [&](int lo, int hi)
+                    {
+            for (int t = lo; t < hi; t++)
+            {
+                int r0 = (t / col_tiles) * tile_rows, c0 = (t % col_tiles) * tile_cols;
+                fn(r0, std::min(rows, r0 + tile_rows), c0, std::min(cols, c0 + tile_cols));
+            } });
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<int> pending{0};
+    std::atomic<unsigned> next_queue{0};
+    std::mutex sleep_mtx;
+    std::condition_variable sleep_cv;
+    bool stopping = false;
+
+    static inline thread_local ThreadPool *current_pool = nullptr;
+    static inline thread_local int current_index = 0;
+
+    static void pinThread(std::thread &t, int index)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &set);
+        pthread_setaffinity_np(t.native_handle(), sizeof(cpu_set_t), &set);
+#endif
+    }
+
+    bool pop(int index, bool own, Task &task)
+    {
+        Queue &q = *queues[index];
+        std::lock_guard<std::mutex> lck(q.mtx);
+        if (q.tasks.empty())
+            return false;
+        if (own)
+        {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        pending--;
+        return true;
+    }
+
+    // run one task: our own newest first, otherwise steal someone's oldest
+    bool runOne(int self)
+    {
+        Task task;
+        int n = queues.size();
+        bool found = self >= 0 && pop(self, true, task);
+        for (int k = 1; !found && k <= n; k++)
+            found = pop((std::max(self, 0) + k) % n, false, task);
+        if (!found)
+            return false;
+        task();
+        return true;
+    }
+
+    void waitFor(std::atomic<int> &remaining)
+    {
+        int self = (current_pool == this) ? current_index : -1;
+        while (remaining > 0)
+        {
+            if (!runOne(self))
+                std::this_thread::yield();
+        }
+    }
+
+    void workerLoop(int index)
+    {
+        current_pool = this;
+        current_index = index;
+        while (true)
+        {
+            if (runOne(index))
+                continue;
+            std::unique_lock<std::mutex> lck(sleep_mtx);
+            sleep_cv.wait(lck, [this]()
+                          { return stopping || pending > 0; });
+            if (stopping && pending == 0)
+                return;
+        }
+    }
+};
+
+inline ThreadPool &defaultPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+// gemm() cut into 2D tiles of C and spread over the pool. Each tile packs
+// its own panels in the running thread's workspace.
+template <typename OutT>
+void parallelGemm(ThreadPool &pool, int M, int N, int K, const int32_t *A, int lda, const int32_t *B, int ldb, OutT *C, int ldc)
+{
+    // aim for a few tiles per thread so stealing can even out the tail
+    int tile_rows = 2 * GEMM_MC, tile_cols = GEMM_NC / 4;
+    while (tile_rows > GEMM_MC / 2 && (long long)((M + tile_rows - 1) / tile_rows) * ((N + tile_cols - 1) / tile_cols) < 4LL * pool.size())
+    {
+        if (tile_cols > 128)
+            tile_cols /= 2;
+        else
+            tile_rows /= 2;
+    }
+    pool.parallelFor2D(M, N, tile_rows, tile_cols, [&](int r0, int r1, int c0, int c1)
+                       { gemm<OutT>(r1 - r0, c1 - c0, K, A + (size_t)r0 * lda, lda, B + c0, ldb, C + (size_t)r0 * ldc + c0, ldc); });
+}
@@ -3,13 +3,34 @@
 class Vector {
   size: number;
   data: number[];
+  // stored indices of a sparse vector (data then holds their values), or
+  // null for a dense one
+  index: number[] | null;
 
   constructor() {
     this.size = 0;
     this.data = [];
+    this.index = null;
   }
 
   deserialize(str: string) {
+    if (str.startsWith("@")) {
+      // "@size delta:value delta:value ..."
+      let [size, ...pairs] = str.slice(1).split(" ");
+      this.size = parseInt(size);
+      this.index = [];
+      this.data = [];
+      let index = -1;
+      for (let pair of pairs) {
+        if (pair.length == 0) continue;
+        let [delta, value] = pair.split(":");
+        index += parseInt(delta);
+        this.index.push(index);
+        this.data.push(parseInt(value));
+      }
+      return;
+    }
+    this.index = null;
     this.data = str
       .split(" ")
       .map((x) => parseInt(x))
@@ -19,6 +40,17 @@ class Vector {
 
   dot(other: Vector) {
     let result = 0;
+    if (this.index != null && other.index != null) {
+      let i = 0,
+        j = 0;
+      while (i < this.index.length && j < other.index.length) {
+        if (this.index[i] == other.index[j])
+          result += this.data[i++] * other.data[j++];
+        else if (this.index[i] < other.index[j]) i++;
+        else j++;
+      }
+      return result;
+    }
     for (let i = 0; i < this.size; i++) {
       result += this.data[i] * other.data[i];
     }
@@ -26,6 +58,38 @@ class Vector {
   }
 }
 
+// LRU cache of operands by id. The server mirrors it for this node to know
+// which operands it can send as a bare "=id", so hits and evictions have to
+// happen in exactly the order operands arrive.
+class OperandCache {
+  capacity: number;
+  entries: Map<number, Vector>; // iterates least recently used first
+
+  constructor(capacity: number) {
+    this.capacity = capacity;
+    this.entries = new Map();
+  }
+
+  find(id: number) {
+    let v = this.entries.get(id);
+    if (v === undefined) return null;
+    this.entries.delete(id);
+    this.entries.set(id, v);
+    return v;
+  }
+
+  insert(id: number, v: Vector) {
+    this.entries.delete(id);
+    if (this.entries.size >= this.capacity) {
+      let oldest = this.entries.keys().next().value;
+      if (oldest !== undefined) this.entries.delete(oldest);
+    }
+    this.entries.set(id, v);
+  }
+}
+
+const CACHE_ENTRIES = 1024;
+
 function splitString(str: string, delimiter: string = ";;") {
   return str.split(delimiter);
 }
@@ -48,21 +112,47 @@ export class NodeHandler {
   stopHandler: () => void;
   node_id: number;
   action_id: number;
-  a: Vector;
-  b: Vector;
+  // one vector each, or a block of them ("v/v/v") when the job is tiled
+  a: Vector[];
+  b: Vector[];
   computed_count: number;
+  cache: OperandCache;
 
   constructor(node_id: number, stopHandler: () => void) {
     this.node_id = node_id;
     this.stopHandler = stopHandler;
     this.action_id = -1;
-    this.a = new Vector();
-    this.b = new Vector();
+    this.a = [];
+    this.b = [];
     this.computed_count = 0;
+    this.cache = new OperandCache(CACHE_ENTRIES);
   }
 
   makeEnterMessage() {
-    return formatMessage(this.node_id, "ENTER", -1, "");
+    return formatMessage(this.node_id, "ENTER", -1, `CACHE ${CACHE_ENTRIES}`);
+  }
+
+  // "=id" is an operand we already hold; "=id,operand" is one to keep
+  readOperand(data: string) {
+    let v = new Vector();
+    if (!data.startsWith("=")) {
+      v.deserialize(data);
+      return v;
+    }
+    let comma = data.indexOf(",");
+    let id = parseInt(data.slice(1, comma < 0 ? undefined : comma));
+    if (comma < 0) {
+      let hit = this.cache.find(id);
+      if (hit == null) {
+        console.log(`Operand ${id} is not cached. Exiting...`);
+        this.stopHandler();
+        return v;
+      }
+      return hit;
+    }
+    v.deserialize(data.slice(comma + 1));
+    this.cache.insert(id, v);
+    return v;
   }
 
   makeCloseMessage() {
@@ -106,8 +196,8 @@ export class NodeHandler {
 
   handleAssignAction(got_action_id: number, data: string) {
     this.action_id = got_action_id;
-    this.a = new Vector();
-    this.b = new Vector();
+    this.a = [];
+    this.b = [];
     console.log("Assigned action: " + this.action_id);
     return ["GET_A", ""];
   }
@@ -119,8 +209,8 @@ export class NodeHandler {
       return ["", ""];
     }
 
-    this.a.deserialize(data);
-    console.log("Received vector A with size: " + this.a.size);
+    this.a = data.split("/").map((x) => this.readOperand(x));
+    console.log(`Received ${this.a.length} vector(s) A with size: ${this.a[0].size}`);
     return ["GET_B", ""];
   }
 
@@ -131,11 +221,13 @@ export class NodeHandler {
       return ["", ""];
     }
 
-    this.b.deserialize(data);
+    this.b = data.split("/").map((x) => this.readOperand(x));
 
-    let result = this.a.dot(this.b);
+    // every a x b dot product, row-major, each followed by a space
+    let results = "";
+    for (let a of this.a) for (let b of this.b) results += a.dot(b) + " ";
     this.computed_count += 1;
-    return ["RETURN", result.toString()];
+    return ["RETURN", results];
   }
 
   async messageHandler(message: string) {